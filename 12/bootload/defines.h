@@ -3,6 +3,8 @@
 
 #define NULL ((void *)0)
 #define SERIAL_DEFAULT_DEVICE 1
+#define SERIAL_DEFAULT_BAUDRATE 9600
+#define CPU_CLOCK 20000000 // CPU のクロック周波数(20MHz)
 
 typedef unsigned char   uint8;
 typedef unsigned short  uint16;
@@ -56,40 +56,99 @@ static int elf_check(struct elf_header *header)
     return 0;
 }
 
-static int elf_load_program(struct elf_header *header)
+// ELF ファイルを先頭から少しずつ受け取り、セグメントを直接ロード先に書き込む
+// 受信したファイル全体をバッファにためてからコピーすると、バッファの分だけ
+// ロードできる OS のサイズが小さくなるため
+// ファイルの先頭部分(ELF ヘッダとプログラムヘッダ)だけは控えておき、
+// ヘッダがそろった時点でそれまでに受け取ったデータもロード先に書き込む
+//
+// 圧縮したイメージ(OS の Makefile の kzpack で作る)も受け付ける
+// 先頭が "KZLZ" なら、展開後のサイズ(4バイト、ビッグエンディアン)に続く LZSS の
+// データを展開しながら、ELF ファイルとして同じように処理する
+// LZSS のデータは、フラグ1バイト(下位ビットから順に、1 ならそのままの1バイト、
+// 0 なら2バイトの一致情報)とそれに続く8個のデータの繰り返し
+// 一致情報は上位9ビットが何バイト前か(1〜512)、下位7ビットが長さ(3〜130)
+static struct {
+    char *header_buf;   // ファイルの先頭部分を控えておく領域
+    long pos;           // ここまでに受け取ったデータのサイズ(ファイル中の位置)
+    int ready;          // ヘッダを解析し終え、セグメントを書き込めるか
+    int started;        // 先頭のブロックを受け取ったか(圧縮の有無を判定済みか)
+
+    // 圧縮したイメージの展開の状態
+    int compressed;     // 圧縮したイメージか
+    long lz_remain;     // 展開後のデータの残りのサイズ
+    char *lz_window;    // 展開したデータの履歴(ELF_LZ_WINDOW_SIZE バイトのリング)
+    int lz_pos;         // 次に展開したデータを書き込む履歴の位置
+    int lz_done;        // 履歴のうち ELF として処理した位置
+    unsigned int lz_flags; // 残りのフラグ(番兵の 1 だけになったら次はフラグ)
+    int lz_half;        // 一致情報の1バイト目を受け取ったか
+    unsigned char lz_hi; // 一致情報の1バイト目
+} elf_stream;
+
+#define ELF_LZ_MAGIC "KZLZ"
+#define ELF_LZ_HEADER_SIZE 8
+#define ELF_LZ_LEN_BITS 7
+#define ELF_LZ_LEN_MIN 3
+
+static struct elf_program_header *elf_program_header(struct elf_header *header,
+                                                     int index)
 {
-    int i;
+    return (struct elf_program_header *)
+        ((char *)header + header->program_header_offset +
+         header->program_header_size * index);
+}
+
+// ロード可能なセグメントが、ブートローダが使っていない RAM に収まるかを確認
+// (受信バッファやスタックを上書きすると、ロードの途中で動かなくなる)
+static int elf_check_program(struct elf_header *header)
+{
+    // リンカスクリプトで定義したロードしてよい範囲
+    extern char loadarea_start, loadarea_end;
     struct elf_program_header *phdr;
+    int i;
 
-    // プログラムヘッダの個数分(セグメントの個数分)ループする
     for (i = 0; i < header->program_header_num; i++) {
-        // プログラムヘッダを取得
-        phdr = (struct elf_program_header *)
-            ((char *)header + header->program_header_offset +
-             header->program_header_size * i);
+        phdr = elf_program_header(header, i);
+        if (phdr->type != 1)
+            continue;
+        if (phdr->file_size > phdr->memory_size)
+            return -1;
+        if ((phdr->physical_addr < (long)&loadarea_start) ||
+            (phdr->physical_addr + phdr->memory_size > (long)&loadarea_end))
+            return -1;
+    }
+
+    return 0;
+}
 
-        // ロード可能なセグメントかを確認
+// ファイル中の位置 pos から size バイトのデータのうち、
+// ロード可能なセグメントに含まれる部分を物理アドレスの場所に書き込む
+static void elf_load_data(struct elf_header *header, long pos,
+                          char *buf, long size)
+{
+    struct elf_program_header *phdr;
+    long start, end;
+    int i;
+
+    for (i = 0; i < header->program_header_num; i++) {
+        phdr = elf_program_header(header, i);
         if (phdr->type != 1)
             continue;
-        
+
+        // 受け取ったデータとセグメントが重なる範囲
+        start = (pos > phdr->offset) ? pos : phdr->offset;
+        end = pos + size;
+        if (end > phdr->offset + phdr->file_size)
+            end = phdr->offset + phdr->file_size;
+        if (start >= end)
+            continue;
+
         // 物理アドレス: 変数の初期値が格納されるアドレス
         // 論理アドレス: プログラムが実行時にアクセスするアドレス
         // プログラムが ROM に書き込まれる場合、実行時には書き換えられないので　物理 != 論理 になる
-
-        // elf ヘッダの先頭からオフセット分だけずらした位置から、
-        // 物理アドレスの場所に対象のセグメントをロードする
-        memcpy((char *)phdr->physical_addr, (char *)header + phdr->offset,
-               phdr->file_size);
-        // RAM 領域で、セグメントをコピーしたところから後ろをゼロクリアする
-        // bss　領域などは、elf ファイル上は実体は不要だが、RAM 上には領域が必要
-        // よって memory_size と file_size で差がでることがある
-        // ここはゼロクリアする
-        // おそらく elf ファイル上に実体がない領域はセグメントの後ろ側に集められる仕様になっている
-        memset((char *)phdr->physical_addr + phdr->file_size, 0,
-               phdr->memory_size - phdr->file_size);
+        memcpy((char *)phdr->physical_addr + (start - phdr->offset),
+               buf + (start - pos), end - start);
     }
-
-    return 0;
 }
 
 // boot loader: モトローラSレコードフォーマット
@@ -97,16 +156,260 @@ static int elf_load_program(struct elf_header *header)
 // ブートローダはモトローラSレコードフォーマットで書き込まれる
 // これは H8 がこのフォーマットのバイナリを期待しているため
 // OS 側のフォーマットは(ブートローダが期待する形式なら)なんでもいい
-char *elf_load(char *buf)
+
+// ストリームでのロードを開始する
+// buf には ELF_STREAM_BUF_SIZE バイトの領域を渡す
+// (先頭にヘッダを控え、その後ろを圧縮したイメージの展開に使う)
+int elf_stream_init(char *buf)
+{
+    memset(&elf_stream, 0, sizeof(elf_stream));
+    elf_stream.header_buf = buf;
+    elf_stream.lz_window = buf + ELF_HEADER_BUF_SIZE;
+    elf_stream.lz_flags = 1;
+    return 0;
+}
+
+// 展開後(圧縮していなければ受信したまま)の ELF ファイルの続きを処理する
+static int elf_stream_data(char *buf, int size)
 {
-    struct elf_header *header = (struct elf_header *)buf;
+    struct elf_header *header = (struct elf_header *)elf_stream.header_buf;
+    long n, header_size;
+
+    if (!elf_stream.ready) {
+        // ヘッダの解析が終わるまでは、ファイルの先頭部分を控えておく
+        n = ELF_HEADER_BUF_SIZE - elf_stream.pos;
+        if (n > size)
+            n = size;
+        memcpy(elf_stream.header_buf + elf_stream.pos, buf, n);
+        elf_stream.pos += n;
+        buf  += n;
+        size -= n;
+
+        if (elf_stream.pos < sizeof(struct elf_header))
+            return 0;
+        if (elf_check(header) < 0)
+            return -1;
+
+        // プログラムヘッダは控えておく領域に収まらなければならない
+        header_size = header->program_header_offset +
+            (long)header->program_header_size * header->program_header_num;
+        if (header_size > ELF_HEADER_BUF_SIZE)
+            return -1;
+        if (elf_stream.pos < header_size)
+            return 0;
+
+        if (elf_check_program(header) < 0)
+            return -1;
+
+        // ここまでに受け取った分をロード先に書き込む
+        elf_stream.ready = 1;
+        elf_load_data(header, 0, elf_stream.header_buf, elf_stream.pos);
+    }
+
+    elf_load_data(header, elf_stream.pos, buf, size);
+    elf_stream.pos += size;
+
+    return 0;
+}
+
+// 展開したデータのうち、まだ処理していない分を ELF ファイルとして処理する
+static int elf_lz_flush(void)
+{
+    int r;
+
+    r = elf_stream_data(elf_stream.lz_window + elf_stream.lz_done,
+                        elf_stream.lz_pos - elf_stream.lz_done);
+    elf_stream.lz_done = elf_stream.lz_pos;
+
+    return r;
+}
+
+// 展開したデータを1バイト履歴に追加する
+// 履歴が一杯になったら、上書きする前に ELF ファイルとして処理する
+static int elf_lz_put(char c)
+{
+    elf_stream.lz_window[elf_stream.lz_pos++] = c;
+    elf_stream.lz_remain--;
+
+    if (elf_stream.lz_pos == ELF_LZ_WINDOW_SIZE) {
+        if (elf_lz_flush() < 0)
+            return -1;
+        elf_stream.lz_pos = elf_stream.lz_done = 0;
+    }
 
-    if (elf_check(header) < 0)
+    return 0;
+}
+
+// 圧縮したイメージの続きを展開する
+// 展開後のサイズに達したら、残り(XMODEM のブロックの詰め物)は読み捨てる
+static int elf_lz_write(unsigned char *buf, int size)
+{
+    unsigned int code;
+    int i, offset, len;
+
+    for (i = 0; (i < size) && elf_stream.lz_remain; i++) {
+        if (elf_stream.lz_flags == 1) {
+            // 8個分のフラグの上に番兵を置いておく
+            elf_stream.lz_flags = buf[i] | 0x100;
+        } else if (elf_stream.lz_flags & 1) {
+            // そのままの1バイト
+            if (elf_lz_put(buf[i]) < 0)
+                return -1;
+            elf_stream.lz_flags >>= 1;
+        } else if (!elf_stream.lz_half) {
+            elf_stream.lz_hi = buf[i];
+            elf_stream.lz_half = 1;
+        } else {
+            // 一致情報: 履歴の offset バイト前から len バイトをコピーする
+            // (重なっていてもよいように1バイトずつコピーする)
+            code = ((unsigned int)elf_stream.lz_hi << 8) | buf[i];
+            offset = (code >> ELF_LZ_LEN_BITS) + 1;
+            len = (code & ((1 << ELF_LZ_LEN_BITS) - 1)) + ELF_LZ_LEN_MIN;
+            while (len-- && elf_stream.lz_remain) {
+                if (elf_lz_put(elf_stream.lz_window[(elf_stream.lz_pos - offset) &
+                                                    (ELF_LZ_WINDOW_SIZE - 1)]) < 0)
+                    return -1;
+            }
+            elf_stream.lz_half = 0;
+            elf_stream.lz_flags >>= 1;
+        }
+    }
+
+    return elf_lz_flush();
+}
+
+// ファイルの続きの size バイトを受け取る(xmodem_recv から1ブロックごとに呼ばれる)
+// ELF ファイルでないときや、ロードできないセグメントがあるときは -1 を返す
+int elf_stream_write(char *buf, int size)
+{
+    unsigned char *p = (unsigned char *)buf;
+
+    // 圧縮したイメージかどうかは先頭のブロックで判定する
+    // (XMODEM のブロックは 128 バイト以上あるので、圧縮のヘッダは1ブロックに収まる)
+    if (!elf_stream.started) {
+        elf_stream.started = 1;
+        if ((size >= ELF_LZ_HEADER_SIZE) && !memcmp(buf, ELF_LZ_MAGIC, 4)) {
+            elf_stream.compressed = 1;
+            elf_stream.lz_remain = ((long)p[4] << 24) | ((long)p[5] << 16) |
+                                   ((long)p[6] <<  8) |  (long)p[7];
+            p    += ELF_LZ_HEADER_SIZE;
+            size -= ELF_LZ_HEADER_SIZE;
+        }
+    }
+
+    if (elf_stream.compressed)
+        return elf_lz_write(p, size);
+
+    return elf_stream_data(buf, size);
+}
+
+// ストリームでのロードを終了し、エントリポイントのアドレスを返す
+// ファイルが途中で切れていてセグメントがそろっていなければ NULL を返す
+char *elf_stream_end(void)
+{
+    struct elf_header *header = (struct elf_header *)elf_stream.header_buf;
+    struct elf_program_header *phdr;
+    int i;
+
+    if (!elf_stream.ready)
         return NULL;
-    
-    if (elf_load_program(header) < 0)
+    // 圧縮したイメージが途中で切れている
+    if (elf_stream.compressed && elf_stream.lz_remain)
         return NULL;
-    
+
+    for (i = 0; i < header->program_header_num; i++) {
+        phdr = elf_program_header(header, i);
+        if (phdr->type != 1)
+            continue;
+        if (phdr->offset + phdr->file_size > elf_stream.pos)
+            return NULL;
+
+        // RAM 領域で、セグメントをコピーしたところから後ろをゼロクリアする
+        // bss　領域などは、elf ファイル上は実体は不要だが、RAM 上には領域が必要
+        // よって memory_size と file_size で差がでることがある
+        memset((char *)phdr->physical_addr + phdr->file_size, 0,
+               phdr->memory_size - phdr->file_size);
+    }
+
     // elf ファイル内に書かれたエントリポイントのアドレスを返す
     return (char *)header->entry_point;
 }
+
+// OS のイメージの情報(リンク後に OS の Makefile の kzcrc が書き込む)
+// OS の ld.scr で RAM の決まったアドレス(_kzimage)に置かれ、セグメントと一緒にロードされる
+// RAM 上の各範囲の CRC32 を検査する
+// - ロードした直後は、ロード可能な各セグメント(.data も含む)を検査する
+// - verify コマンドでは、OS の実行中に書き換えられない .text と .rodata だけを検査する
+//   (OS を動かしたあとでも検査でき、そのままもう一度起動できる)
+// (CRC32 は、この情報自体が置かれた範囲を 0 とみなして計算する)
+#define ELF_IMAGE_MAGIC 0x4b5a494d /* "KZIM" */
+#define ELF_IMAGE_SEGMENT_NUM 6
+
+struct elf_image {
+    uint32 magic;
+    uint32 entry_point;
+    uint16 segment_num; // セグメントの数(segments[] の先頭から並ぶ)
+    uint16 section_num; // .text と .rodata の数(セグメントの後ろに並ぶ)
+    struct {
+        uint32 addr;    // 範囲の先頭のアドレス
+        uint32 size;    // 範囲のサイズ
+        uint32 crc;     // CRC32
+    } segments[ELF_IMAGE_SEGMENT_NUM];
+};
+
+// CRC32(生成多項式 0xedb88320 のビット反転形式)を4ビットずつ計算するための表
+static const uint32 elf_crc32_table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+static uint32 elf_crc32(struct elf_image *image, char *p, long size)
+{
+    uint32 crc = 0xffffffff;
+    unsigned char c;
+
+    for (; size > 0; size--, p++) {
+        c = *p;
+        // イメージの情報自体は 0 とみなす
+        if ((p >= (char *)image) && (p < (char *)(image + 1)))
+            c = 0;
+        crc ^= c;
+        crc = (crc >> 4) ^ elf_crc32_table[crc & 0xf];
+        crc = (crc >> 4) ^ elf_crc32_table[crc & 0xf];
+    }
+
+    return ~crc;
+}
+
+// RAM 上にある OS のイメージを検査し、正しければエントリポイントを返す
+// warm が 0 ならロード直後の検査(セグメント)、0 以外なら verify コマンドの検査(セクション)
+// 一致しなかった範囲の数を *errors に返す(イメージの情報がなければ -1)
+char *elf_verify(int warm, int *errors)
+{
+    extern char kzimage, loadarea_start, loadarea_end;
+    struct elf_image *image = (struct elf_image *)&kzimage;
+    int i, start, end;
+
+    *errors = -1;
+    if ((image->magic != ELF_IMAGE_MAGIC) ||
+        (image->segment_num + image->section_num > ELF_IMAGE_SEGMENT_NUM))
+        return NULL;
+
+    start = warm ? image->segment_num : 0;
+    end   = warm ? image->segment_num + image->section_num : image->segment_num;
+
+    *errors = 0;
+    for (i = start; i < end; i++) {
+        // ロードできる領域の外を指していれば、壊れた情報として扱う
+        if ((image->segments[i].addr < (long)&loadarea_start) ||
+            (image->segments[i].addr + image->segments[i].size >
+             (long)&loadarea_end) ||
+            (elf_crc32(image, (char *)image->segments[i].addr,
+                       image->segments[i].size) != image->segments[i].crc))
+            (*errors)++;
+    }
+
+    return *errors ? NULL : (char *)image->entry_point;
+}
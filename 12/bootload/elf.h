@@ -1,6 +1,18 @@
 #ifndef _ELF_H_INCLUDED_
 #define _ELF_H_INCLUDED_
 
-char *elf_load(char *buf);
+// ELF ヘッダとプログラムヘッダを控えておく領域のサイズ
+// (ELF ヘッダ 52 バイトとプログラムヘッダ 32 バイト x 6 個まで)
+#define ELF_HEADER_BUF_SIZE 256
+// 圧縮したイメージを展開するための履歴のサイズ
+// (圧縮の形式で、一致位置を9ビットで表しているのに合わせる)
+#define ELF_LZ_WINDOW_SIZE 512
+// elf_stream_init に渡す作業領域のサイズ
+#define ELF_STREAM_BUF_SIZE (ELF_HEADER_BUF_SIZE + ELF_LZ_WINDOW_SIZE)
 
-#endif
\ No newline at end of file
+int elf_stream_init(char *buf);
+int elf_stream_write(char *buf, int size);
+char *elf_stream_end(void);
+char *elf_verify(int warm, int *errors);
+
+#endif
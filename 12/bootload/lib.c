@@ -2,18 +2,73 @@
 #include "serial.h"
 #include "lib.h"
 
+// memset, memcpy, memcmp は、スタックの初期化や ELF のロードなどで大きな領域に使うので、
+// アドレスがそろっていれば 32 ビット単位で処理する(memcpy は大きければ eepmov.w を使う)
+// H8/300H では 16/32 ビットのアクセスは偶数アドレスであればよいので、
+// 先頭の1バイトで偶数アドレスにそろえ、末尾の端数はバイト単位で処理する
+#define MEM_ALIGNED(p) (!((long)(p) & 1))
+
 void *memset(void *b, int c, long len)
 {
-    char *p;
-    for (p = b; len > 0; len--)
+    char *p = b;
+    uint32 *lp;
+    uint32 v;
+
+    if (!MEM_ALIGNED(p) && (len > 0)) {
+        *(p++) = c;
+        len--;
+    }
+
+    // 1バイトの値を 32 ビットに並べて書き込む
+    v = (uint8)c;
+    v |= v << 8;
+    v |= v << 16;
+    for (lp = (uint32 *)p; len >= 4; len -= 4)
+        *(lp++) = v;
+
+    for (p = (char *)lp; len > 0; len--)
         *(p++) = c;
     return b;
 }
 
+// ブロック転送命令 eepmov.w は1バイトあたり約4ステートで、32 ビット単位のループ
+// (4バイトあたり約30ステート)より速いので、ある程度の大きさがあれば
+// アドレスの奇偶にかかわらず eepmov.w で転送する
+// 呼び出しとレジスタの退避・復元に約40ステートかかるので、小さい転送では
+// 奇偶がそろっていれば 32 ビット単位のループのほうが速い(12バイトほどで逆転する)
+// 奇偶がそろっていなければワード単位で転送できないので、小さくても eepmov.w を使う
+// memcpy_eepmov は startup.s で定義している(一度に転送できるのは 0xffff バイトまで)
+#define MEMCPY_EEPMOV_MIN 16
+void memcpy_eepmov(char *dst, const char *src, unsigned int len);
+
 void *memcpy(void *dst, const void *src, long len)
 {
     char *d = dst;
     const char *s = src;
+    uint32 *ld;
+    const uint32 *ls;
+    unsigned int n;
+
+    if ((len >= MEMCPY_EEPMOV_MIN) || (MEM_ALIGNED(d) != MEM_ALIGNED(s))) {
+        for (; len > 0; len -= n, d += n, s += n) {
+            n = (len > 0xffff) ? 0xffff : len;
+            memcpy_eepmov(d, s, n);
+        }
+        return dst;
+    }
+
+    if (!MEM_ALIGNED(d) && (len > 0)) {
+        *(d++) = *(s++);
+        len--;
+    }
+
+    ld = (uint32 *)d;
+    ls = (const uint32 *)s;
+    for (; len >= 4; len -= 4)
+        *(ld++) = *(ls++);
+
+    d = (char *)ld;
+    s = (const char *)ls;
     for (; len > 0; len--)
         *(d++) = *(s++);
     return dst;
@@ -22,6 +77,28 @@ void *memcpy(void *dst, const void *src, long len)
 int memcmp(const void *b1, const void *b2, long len)
 {
     const char *p1 = b1, *p2 = b2;
+    const uint32 *l1, *l2;
+
+    // 奇偶がそろっていれば、一致している部分は 32 ビット単位で読み飛ばす
+    // 違いのある4バイトは、大小を決めるためにバイト単位で比べ直す
+    if (MEM_ALIGNED(p1) == MEM_ALIGNED(p2)) {
+        if (!MEM_ALIGNED(p1) && (len > 0)) {
+            if (*p1 != *p2)
+                return (*p1 > *p2) ? 1 : -1;
+            p1++;
+            p2++;
+            len--;
+        }
+        l1 = (const uint32 *)p1;
+        l2 = (const uint32 *)p2;
+        for (; (len >= 4) && (*l1 == *l2); len -= 4) {
+            l1++;
+            l2++;
+        }
+        p1 = (const char *)l1;
+        p2 = (const char *)l2;
+    }
+
     for (; len > 0; len--) {
         if (*p1 != *p2)
             return (*p1 > *p2) ? 1 : -1;
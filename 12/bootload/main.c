@@ -47,6 +47,73 @@ static int dump(char *buf, long size)
     return 0;
 }
 
+// 10進数の文字列を数値に変換する(数字以外の文字があれば -1)
+static long atol_dec(char *str)
+{
+    long value = 0;
+
+    if (!*str)
+        return -1;
+    for (; *str; str++) {
+        if ((*str < '0') || (*str > '9'))
+            return -1;
+        value = value * 10 + (*str - '0');
+    }
+
+    return value;
+}
+
+// シリアルのボーレートを変更する(XMODEM での転送を速くするため)
+// 応答を送り終えてから切り替えるので、そのあと端末側の速度も合わせること
+// ロードした OS はデフォルトのボーレートで初期化し直す
+static int baud(char *str)
+{
+    long baudrate;
+
+    baudrate = atol_dec(str);
+    if (baudrate <= 0) {
+        puts("usage: baud <bps>\n");
+        return -1;
+    }
+
+    puts("switching to ");
+    puts(str);
+    puts(" bps.\n");
+    if (serial_init_baud(SERIAL_DEFAULT_DEVICE, baudrate) < 0) {
+        // 設定できないボーレートのときは、シリアルの設定は変わっていない
+        puts("unsupported baudrate.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// RAM 上の OS のイメージを、埋め込まれた CRC32 で検査する
+// warm が 0 ならロードした直後としてすべてのセグメントを、0 以外なら
+// 一度動いたあとでも変わらない .text と .rodata だけを検査する
+// 正しければエントリポイントを、壊れていれば NULL を返す
+// 検査用の情報がないイメージ(kzcrc を通していない)なら entry_point をそのまま返す
+static char *verify(char *entry_point, int warm)
+{
+    int errors;
+    char *p;
+
+    p = elf_verify(warm, &errors);
+    if (errors < 0) {
+        puts("no image info.\n");
+        return entry_point;
+    }
+    if (errors) {
+        puts("verify error: ");
+        putxval(errors, 0);
+        puts(" range(s) corrupted.\n");
+        return NULL;
+    }
+    puts("verify OK.\n");
+
+    return p;
+}
+
 static void wait()
 {
     volatile long i;
@@ -59,9 +126,9 @@ int main(void)
     static char buf[16];
     static long size = -1;
     static unsigned char *loadbuf = NULL;
-
     // ロードした OS のエントリポイントアドレス
-    char *entry_point;
+    static char *entry_point = NULL;
+
     void (*f)(void);
 
     // リンカスクリプトで定義されるもの、受信したデータを置く先頭アドレス
@@ -80,24 +147,43 @@ int main(void)
 
         if (!strcmp(buf, "load")) {
             // xmodem でのダウンロードを開始する
+            // 受信したブロックはそのつど ELF ファイルとして解析し、
+            // セグメントをロード先に直接書き込む
+            // 受信領域の先頭は1ブロック分の受信用で、その後ろは ELF のヘッダを控える
+            // 領域と、圧縮したイメージの展開用(ELF_STREAM_BUF_SIZE バイト)
             loadbuf = (char *)(&buffer_start);
-            size = xmodem_recv(loadbuf);
+            elf_stream_init(loadbuf + XMODEM_BLOCK_SIZE_MAX);
+            size = xmodem_recv(loadbuf, elf_stream_write);
+            entry_point = (size < 0) ? NULL : elf_stream_end();
 
             // OS の受信後、少し待つ
             wait();
 
             if (size < 0) {
                 puts("\nXMODEM receive error!\n");
+            } else if (!entry_point) {
+                puts("\nELF load error!\n");
             } else {
                 puts("\nXMODEM receive succeeded.\n");
+                // XMODEM のブロックごとの検査に加えて、ロードした結果を検査する
+                entry_point = verify(entry_point, 0);
             }
+        } else if (!strncmp(buf, "baud ", 5)) {
+            baud(buf + 5);
+        } else if (!strcmp(buf, "verify")) {
+            // リセット後も RAM に残っている OS を検査し、正しければ load せずに run できる
+            // .data と .bss は一度動いた OS が書き換えているので検査しない
+            // (OS は初期値のあるデータを持たず、起動時に .bss をクリアする)
+            entry_point = verify(NULL, 1);
         } else if (!strcmp(buf, "dump")) {
             puts("size: ");
             putxval(size, 0);
             puts("\n");
-            dump(loadbuf, size);
+            // ファイル全体は残っていないので、控えておいた先頭部分(ヘッダ)を表示する
+            dump(loadbuf + XMODEM_BLOCK_SIZE_MAX,
+                 (size < ELF_HEADER_BUF_SIZE) ? size : ELF_HEADER_BUF_SIZE);
         } else if (!strcmp(buf, "run")) {
-            entry_point = elf_load(loadbuf);
+            // セグメントはロード時に書き込んであるので、エントリポイントに飛ぶだけ
             if (!entry_point) {
                 puts("run error!\n");
             } else {
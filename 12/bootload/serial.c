@@ -58,13 +58,50 @@ static struct {
     { H8_3069F_SCI2 },
 };
 
-int serial_init(int index)
+// 設定できるボーレートの誤差の上限(千分率)
+// 調歩同期では1文字(10ビット)の間のずれを半ビット未満に抑える必要があり、
+// 相手側の誤差もあるので、こちら側は 2% までとする
+#define SERIAL_BAUDRATE_ERROR_MAX 20
+
+// ボーレートを指定してシリアルデバイスを初期化する
+// ボーレートは BRR = CPU_CLOCK / (64 * 2^(2n-1) * B) - 1 で決まる(n は SMR の CKS)
+// 分周比の小さい CKS から順に BRR(0〜255) に収まるものを探し、
+// 誤差が大きすぎて設定できないボーレートなら -1 を返す
+// (20MHz では 9600bps の誤差は 0.16%、38400bps は 1.7%、57600bps は 1.4% で、
+//  115200bps は 8.5% になるので設定できない)
+int serial_init_baud(int index, long baudrate)
 {
     volatile struct h8_3069f_sci *sci = regs[index].sci;
+    long div, n, actual, error;
+    int cks;
+
+    if (baudrate <= 0)
+        return -1;
+
+    for (cks = 0; cks < 4; cks++) {
+        // 64 * 2^(2n-1) = 32 * 4^n
+        div = 32L << (2 * cks);
+        // BRR + 1 を四捨五入で求める
+        n = (CPU_CLOCK + div * baudrate / 2) / (div * baudrate);
+        if ((n >= 1) && (n <= 256))
+            break;
+    }
+    if (cks == 4)
+        return -1;
+
+    actual = CPU_CLOCK / (div * n);
+    error = (actual > baudrate) ? (actual - baudrate) : (baudrate - actual);
+    if (error * 1000 / baudrate > SERIAL_BAUDRATE_ERROR_MAX)
+        return -1;
+
+    // 送信中の文字があれば、送り終わるのを待ってから設定を変える
+    // (リセット直後は TEND が立っているのですぐに抜ける)
+    while (!(sci->ssr & H8_3069F_SCI_SSR_TEND))
+        ;
 
     sci->scr = 0;
-    sci->smr = 0;
-    sci->brr = 64;
+    sci->smr = cks;
+    sci->brr = n - 1;
     // 読み書き
     sci->scr = H8_3069F_SCI_SCR_RE | H8_3069F_SCI_SCR_TE;
     sci->ssr = 0;
@@ -72,6 +109,11 @@ int serial_init(int index)
     return 0;
 }
 
+int serial_init(int index)
+{
+    return serial_init_baud(index, SERIAL_DEFAULT_BAUDRATE);
+}
+
 int serial_is_send_enable(int index)
 {
     volatile struct h8_3069f_sci *sci = regs[index].sci;
@@ -2,6 +2,7 @@
 #define _SERIAL_H_INCLUDED_
 
 int serial_init(int index);
+int serial_init_baud(int index, long baudrate);
 int serial_is_send_enable(int index);
 int serial_send_byte(int index, unsigned char b);
 int serial_is_recv_enable(int index);
@@ -12,3 +12,23 @@ _start:
 
 1:
     bra 1b
+
+
+; void memcpy_eepmov(char *dst, const char *src, unsigned int len)
+; ブロック転送命令 eepmov.w で len バイトを転送する(lib.c の memcpy から呼ばれる)
+; eepmov.w は er5 の指すところから er6 の指すところへ r4 バイトを転送する
+; 引数は er0, er1, r2 で渡される、er4〜er6 は呼び出し側の値を保存しておく
+    .global _memcpy_eepmov
+#   .type   _memcpy_eepmov,@function
+_memcpy_eepmov:
+    mov.l   er6,@-er7
+    mov.l   er5,@-er7
+    mov.l   er4,@-er7
+    mov.l   er1,er5
+    mov.l   er0,er6
+    mov.w   r2,r4
+    eepmov.w
+    mov.l   @er7+,er4
+    mov.l   @er7+,er5
+    mov.l   @er7+,er6
+    rts
@@ -4,6 +4,7 @@ extern void start(void);        // スタートアップ
 extern void intr_softerr(void); // ソフトウェアエラー
 extern void intr_syscall(void); // システムコール
 extern void intr_serintr(void); // シリアル割込み
+extern void intr_timintr(void); // タイマ割込み
 
 // リンカスクリプトで適切な位置(メモリ空間の先頭)に配置される
 // 割込みが発生したら、まずブートローダが設定したハンドラが呼び出される
@@ -12,8 +13,11 @@ void (*vectors[])(void) = {
     start, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
     intr_syscall, intr_softerr, intr_softerr, intr_softerr,
     NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL,
+    // 16ビットタイマ チャネル0〜2 の割込みベクタ(IMIA, IMIB, OVI, 予約)
+    intr_timintr, NULL, NULL, NULL,
+    intr_timintr, NULL, NULL, NULL,
+    intr_timintr, NULL, NULL, NULL,
     NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
     NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
     // SCI0 の割込みベクタ
@@ -10,28 +10,66 @@
 #define XMODEM_NAK 0x15
 #define XMODEM_CAN 0x18
 #define XMODEM_EOF 0x1a
+#define XMODEM_CRC 'C'
 
-#define XMODEM_BLOCK_SIZE 128
+#define XMODEM_BLOCK_SIZE    128  // SOH で始まるブロックのサイズ
+#define XMODEM_1K_BLOCK_SIZE XMODEM_BLOCK_SIZE_MAX // STX で始まるブロックのサイズ(XMODEM-1K)
+
+// 'C' を送っても送信側が応答しないときに、チェックサムのモードに切り替えるまでの回数
+#define XMODEM_CRC_RETRY 3
+
+// CRC-16(CCITT, 生成多項式 x^16 + x^12 + x^5 + 1, 初期値 0)を1バイト分更新する
+// 表を持つと ROM を 512 バイト使うので、1ビットずつ計算する
+static uint16 xmodem_crc16(uint16 crc, unsigned char c)
+{
+    int i;
+
+    crc ^= (uint16)c << 8;
+    for (i = 0; i < 8; i++) {
+        if (crc & 0x8000)
+            crc = (crc << 1) ^ 0x1021;
+        else
+            crc <<= 1;
+    }
+
+    return crc;
+}
 
 // ブートローダ側で、受信開始まで定期的に信号を送る
+// 最初は 'C' を送って CRC-16 のモードを要求し、応答がなければ NAK を送って
+// チェックサムのモードで受信する(CRC-16 に対応していない送信側のため)
+// CRC-16 のモードで受信するなら 1 を返す
 static int xmodem_wait(void)
 {
     long cnt = 0;
+    int retry = 0;
 
     while(!serial_is_recv_enable(SERIAL_DEFAULT_DEVICE)) {
         if (++cnt >= 200000) {
             cnt = 0;
-            serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_NAK);
+            if (retry < XMODEM_CRC_RETRY) {
+                retry++;
+                serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CRC);
+            } else {
+                retry = XMODEM_CRC_RETRY + 1;
+                serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_NAK);
+            }
         }
     }
 
-    return 0;
+    // 'C' を送った後に送信が始まったなら CRC-16 のモード
+    return (retry <= XMODEM_CRC_RETRY) ? 1 : 0;
 }
 
 // ブロック単位の受信
-static int xmodem_read_block(unsigned char block_number, char *buf)
+// size は 128(SOH) か 1024(STX)
+// crc が 0 以外なら、末尾の2バイトの CRC-16(上位バイトが先)で検査する
+// 0 なら、末尾の1バイトの加算チェックサムで検査する
+static int xmodem_read_block(unsigned char block_number, char *buf,
+                             int size, int crc)
 {
     unsigned char c, block_num, check_sum;
+    uint16 crc16;
     int i;
 
     block_num = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
@@ -46,31 +84,46 @@ static int xmodem_read_block(unsigned char block_number, char *buf)
         return -1;
 
     check_sum = 0;
+    crc16 = 0;
     // 1バイトずつ受信し buf に書き込んでいく
-    for (i = 0; i < XMODEM_BLOCK_SIZE; i++) {
+    for (i = 0; i < size; i++) {
         c = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
         *(buf++) = c;
-        check_sum += c;
+        if (crc)
+            crc16 = xmodem_crc16(crc16, c);
+        else
+            check_sum += c;
     }
 
-    // 最後にチェックサムを受信し比較する
-    check_sum ^= serial_recv_byte(SERIAL_DEFAULT_DEVICE);
-    if (check_sum)
-        return -1;
+    // 最後にチェックサム(CRC-16)を受信し比較する
+    if (crc) {
+        crc16 ^= (uint16)serial_recv_byte(SERIAL_DEFAULT_DEVICE) << 8;
+        crc16 ^= serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+        if (crc16)
+            return -1;
+    } else {
+        check_sum ^= serial_recv_byte(SERIAL_DEFAULT_DEVICE);
+        if (check_sum)
+            return -1;
+    }
 
     return i;
 }
 
-long xmodem_recv(char *buf)
+// buf は1ブロック分(XMODEM_BLOCK_SIZE_MAX バイト)の受信領域
+// 正しく受信したブロックはそのつど func に渡すので、ファイル全体をためておく必要はない
+// (func の処理が終わってから応答を返すので、その間に送信側が次のブロックを送ることはない)
+// 受信したサイズの合計を返す
+long xmodem_recv(char *buf, xmodem_func_t func)
 {
-    int r, receiving = 0;
+    int r, receiving = 0, crc = 0;
     long size = 0;
     unsigned char c, block_number = 1;
 
     while (1) {
         // 受信開始まで待つ
         if (!receiving)
-            xmodem_wait();
+            crc = xmodem_wait();
 
         c = serial_recv_byte(SERIAL_DEFAULT_DEVICE);
 
@@ -81,18 +134,26 @@ long xmodem_recv(char *buf)
         else if (c == XMODEM_CAN) { // キャンセル
             return -1;
         }
-        else if (c == XMODEM_SOH) { // データ受信を開始
+        else if ((c == XMODEM_SOH) || (c == XMODEM_STX)) { // データ受信を開始
             receiving++;
 
             // 1ブロック分のデータを受信
-            r = xmodem_read_block(block_number, buf);
+            // STX なら 1024 バイトのブロック(送信側は CRC-16 のモードのときだけ使う)
+            r = xmodem_read_block(block_number, buf,
+                                  (c == XMODEM_STX) ? XMODEM_1K_BLOCK_SIZE
+                                                    : XMODEM_BLOCK_SIZE,
+                                  crc);
             if (r < 0) { // エラー
                 serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_NAK);
+            } else if (func(buf, r) < 0) {
+                // 受け取ったデータを処理できなければ、送信側に中止を伝える
+                serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CAN);
+                serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_CAN);
+                return -1;
             } else {
                 // 1ブロック分を正しく受信したら、いったん応答を返す
                 block_number++;
                 size += r;
-                buf  += r;
                 serial_send_byte(SERIAL_DEFAULT_DEVICE, XMODEM_ACK);
             }
         } else {
@@ -1,6 +1,12 @@
 #ifndef _XMODEM_H_INCLUDED_
 #define _XMODEM_H_INCLUDED_
 
-long xmodem_recv(char *buf);
+// 1ブロックの最大サイズ(XMODEM-1K の STX ブロック)
+#define XMODEM_BLOCK_SIZE_MAX 1024
+
+// 正しく受信したブロックを渡す関数の型(エラーなら -1 を返すと受信を中止する)
+typedef int (*xmodem_func_t)(char *buf, int size);
+
+long xmodem_recv(char *buf, xmodem_func_t func);
 
 #endif
@@ -0,0 +1,281 @@
+// XMODEM の受信処理(xmodem.c)をホスト上で検査するテスト
+// (ターゲット用ではないので OBJS には含めない、Makefile の test ターゲットで実行する)
+//
+// シリアルの送受信をスタブに差し替え、送信側が送ってくるバイト列を再生して
+// xmodem_recv に受信させる。受信したデータと、受信側が返した応答の並びを検査する
+// - CRC-16 のモードと、'C' に応答しない送信側のためのチェックサムのモード
+// - 128 バイト(SOH)と 1024 バイト(STX)のブロック
+// - 誤りのあるブロックの再送と、受信を中止する場合
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "serial.h"
+#include "xmodem.h"
+
+#define SOH 0x01
+#define STX 0x02
+#define EOT 0x04
+#define ACK 0x06
+#define NAK 0x15
+#define CAN 0x18
+
+// xmodem.c の xmodem_wait に合わせる
+// 受信可能になるまでの確認をこの回数繰り返すたびに 'C' か NAK を送る
+#define WAIT_COUNT 200000
+// 'C' を送る回数(これを超えるとチェックサムのモードに切り替わる)
+#define CRC_RETRY 3
+
+#define STREAM_SIZE 4096
+#define REPLY_SIZE 64
+#define DATA_SIZE 4096
+
+// 送信側が送ってくるバイト列
+static unsigned char stream[STREAM_SIZE];
+static int stream_len, stream_pos;
+// 送信側が黙っている間の、受信可能かの確認の回数
+static long silence;
+
+// 受信側が返した応答
+static unsigned char reply[REPLY_SIZE];
+static int reply_len;
+
+// func に渡されたデータ
+static char data[DATA_SIZE];
+static long data_len;
+// func がエラーを返すまでのブロック数(負なら返さない)
+static int func_fail;
+
+static int failed;
+
+//--------------------------- シリアルのスタブ ---------------------------
+
+int serial_is_recv_enable(int index)
+{
+    if (silence > 0) {
+        silence--;
+        return 0;
+    }
+    return 1;
+}
+
+unsigned char serial_recv_byte(int index)
+{
+    // ターゲットでは受信待ちのまま止まってしまう
+    if (stream_pos >= stream_len) {
+        printf("NG: receiver read past the end of the stream\n");
+        exit(1);
+    }
+    return stream[stream_pos++];
+}
+
+int serial_send_byte(int index, unsigned char c)
+{
+    if (reply_len < REPLY_SIZE)
+        reply[reply_len++] = c;
+    return 0;
+}
+
+//--------------------------- 送信側のバイト列 ---------------------------
+
+static unsigned short crc16(unsigned char *p, int size)
+{
+    unsigned short crc = 0;
+    int i;
+
+    for (; size > 0; size--, p++) {
+        crc ^= (unsigned short)*p << 8;
+        for (i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+    return crc;
+}
+
+static unsigned char checksum(unsigned char *p, int size)
+{
+    unsigned char sum = 0;
+
+    for (; size > 0; size--, p++)
+        sum += *p;
+
+    return sum;
+}
+
+static void put(unsigned char c)
+{
+    stream[stream_len++] = c;
+}
+
+// 1ブロック分を送信側のバイト列に追加する
+// crc が 0 以外なら CRC-16、0 ならチェックサムを付ける
+// broken が 0 以外なら、誤り検出の値を壊して送る
+static void put_block(int block_number, unsigned char *p, int size,
+                      int crc, int broken)
+{
+    unsigned short c;
+    int i;
+
+    put((size == 1024) ? STX : SOH);
+    put(block_number);
+    put(~block_number);
+    for (i = 0; i < size; i++)
+        put(p[i]);
+    if (crc) {
+        c = crc16(p, size) ^ (broken ? 1 : 0);
+        put(c >> 8);
+        put(c);
+    } else {
+        put(checksum(p, size) ^ (broken ? 1 : 0));
+    }
+}
+
+//--------------------------- テスト ---------------------------
+
+static int recv_func(char *buf, int size)
+{
+    if (func_fail == 0)
+        return -1;
+    if (func_fail > 0)
+        func_fail--;
+    memcpy(data + data_len, buf, size);
+    data_len += size;
+    return 0;
+}
+
+static void reset(long wait)
+{
+    stream_len = stream_pos = 0;
+    silence = wait;
+    reply_len = 0;
+    data_len = 0;
+    func_fail = -1;
+}
+
+static long run(void)
+{
+    static char buf[XMODEM_BLOCK_SIZE_MAX];
+    return xmodem_recv(buf, recv_func);
+}
+
+static void check(char *name, long size, long expect_size,
+                  unsigned char *expect_reply, int expect_reply_len,
+                  unsigned char *expect_data)
+{
+    int ok = 1;
+
+    if (size != expect_size)
+        ok = 0;
+    if ((reply_len != expect_reply_len) ||
+        memcmp(reply, expect_reply, expect_reply_len))
+        ok = 0;
+    if (expect_data && (size > 0) &&
+        ((data_len != size) || memcmp(data, expect_data, size)))
+        ok = 0;
+    if (stream_pos != stream_len)
+        ok = 0;
+
+    printf("%s: %s\n", ok ? "OK" : "NG", name);
+    if (!ok) {
+        int i;
+        printf("  size %ld (expected %ld), read %d of %d bytes, reply:",
+               size, expect_size, stream_pos, stream_len);
+        for (i = 0; i < reply_len; i++)
+            printf(" %02x", reply[i]);
+        printf("\n");
+        failed++;
+    }
+}
+
+int main(void)
+{
+    static unsigned char file[2048];
+    long size;
+    int i;
+
+    for (i = 0; i < sizeof(file); i++)
+        file[i] = i * 7 + (i >> 8);
+
+    // CRC-16 のモードで 128 バイトのブロックを2つ受信する
+    {
+        unsigned char expect[] = { 'C', ACK, ACK, ACK };
+        reset(WAIT_COUNT);
+        put_block(1, file, 128, 1, 0);
+        put_block(2, file + 128, 128, 1, 0);
+        put(EOT);
+        size = run();
+        check("crc16 128-byte blocks", size, 256, expect, sizeof(expect), file);
+    }
+
+    // CRC-16 のモードで 1024 バイトと 128 バイトのブロックを混ぜて受信する
+    {
+        unsigned char expect[] = { 'C', ACK, ACK, ACK };
+        reset(WAIT_COUNT);
+        put_block(1, file, 1024, 1, 0);
+        put_block(2, file + 1024, 128, 1, 0);
+        put(EOT);
+        size = run();
+        check("crc16 1K and 128-byte blocks", size, 1152, expect, sizeof(expect),
+              file);
+    }
+
+    // 'C' に応答しない送信側なら、NAK を送ってチェックサムのモードで受信する
+    {
+        unsigned char expect[] = { 'C', 'C', 'C', NAK, ACK, ACK, ACK };
+        reset(WAIT_COUNT * (CRC_RETRY + 1));
+        put_block(1, file, 128, 0, 0);
+        put_block(2, file + 128, 128, 0, 0);
+        put(EOT);
+        size = run();
+        check("checksum fallback", size, 256, expect, sizeof(expect), file);
+    }
+
+    // CRC-16 が合わないブロックには NAK を返し、再送されたブロックを受け取る
+    {
+        unsigned char expect[] = { 'C', NAK, ACK, ACK };
+        reset(WAIT_COUNT);
+        put_block(1, file, 1024, 1, 1);
+        put_block(1, file, 1024, 1, 0);
+        put(EOT);
+        size = run();
+        check("crc16 error and resend", size, 1024, expect, sizeof(expect), file);
+    }
+
+    // チェックサムが合わないブロックには NAK を返し、再送されたブロックを受け取る
+    {
+        unsigned char expect[] = { 'C', 'C', 'C', NAK, NAK, ACK, ACK };
+        reset(WAIT_COUNT * (CRC_RETRY + 1));
+        put_block(1, file, 128, 0, 1);
+        put_block(1, file, 128, 0, 0);
+        put(EOT);
+        size = run();
+        check("checksum error and resend", size, 128, expect, sizeof(expect),
+              file);
+    }
+
+    // 受け取ったデータを処理できなければ CAN を2つ送って中止する
+    {
+        unsigned char expect[] = { 'C', ACK, CAN, CAN };
+        reset(WAIT_COUNT);
+        func_fail = 1;
+        put_block(1, file, 128, 1, 0);
+        put_block(2, file + 128, 128, 1, 0);
+        size = run();
+        check("abort from receiver", size, -1, expect, sizeof(expect), NULL);
+    }
+
+    // 送信側から CAN が来たら中止する
+    {
+        unsigned char expect[] = { 'C', ACK };
+        reset(WAIT_COUNT);
+        put_block(1, file, 128, 1, 0);
+        put(CAN);
+        size = run();
+        check("abort from sender", size, -1, expect, sizeof(expect), NULL);
+    }
+
+    printf(failed ? "xmodemtest NG\n" : "xmodemtest OK\n");
+
+    return failed ? 1 : 0;
+}
@@ -8,26 +8,56 @@ static void send_use(int index)
 {
     char *p;
     p = kz_kmalloc(3);
+    if (p == NULL)
+        return;
     // 0番目のコンソール
     p[0] = '0';
     p[1] = CONSDRV_CMD_USE;
     // index 番目のシリアルポート
     p[2] = '0' + index;
-    kz_send(MSGBOX_ID_CONSOUTPUT, 3, p);
+    // ドライバが処理を終えて返信するまで待つ
+    // 送信できなかったときだけ、送信先で解放されないのでここで解放する
+    // (ドライバでの処理の失敗は CONSDRV_REPLY_ERROR が返るので区別できる)
+    if (kz_call(MSGBOX_ID_CONSOUTPUT, 3, p, NULL) < 0)
+        kz_kmfree(p);
 }
 
+// 送信バッファが一杯のときに、送信が進むのを待つ時間(ミリ秒)
+#define WRITE_RETRY_MSEC 10
+
 // コンソールへの文字列出力をドライバにメッセージ送信
 static void send_write(char *str)
 {
     char *p;
-    int len;
+    int len, n;
     len = strlen(str);
-    p = kz_kmalloc(len + 2);
-    // 0番目のコンソール
-    p[0] = '0';
-    p[1] = CONSDRV_CMD_WRITE;
-    memcpy(&p[2], str, len);
-    kz_send(MSGBOX_ID_CONSOUTPUT, len + 2, p);
+    while (len > 0) {
+        p = kz_kmalloc(len + 2);
+        // メモリが確保できなければ出力をあきらめる
+        if (p == NULL)
+            return;
+        // 0番目のコンソール
+        p[0] = '0';
+        p[1] = CONSDRV_CMD_WRITE;
+        memcpy(&p[2], str, len);
+        // ドライバが送信バッファに書き込んで返信するまで待つ
+        // 受信待ちのドライバには直接処理が渡るので、スケジューリングを待たずに出力される
+        // 返信のサイズは送信バッファに書き込めた文字数
+        n = kz_call(MSGBOX_ID_CONSOUTPUT, len + 2, p, NULL);
+        // メッセージボックスが一杯で送れなければ、送信先で解放されないのでここで解放する
+        if (n < 0) {
+            kz_kmfree(p);
+            return;
+        }
+        // コンソールが使えなければ、送り直しても書き込めないのであきらめる
+        if (n == CONSDRV_REPLY_ERROR)
+            return;
+        // 書き込めなかった残りは、送信が進んでバッファが空くのを待ってから送り直す
+        str += n;
+        len -= n;
+        if (len > 0)
+            kz_sleep_ms(WRITE_RETRY_MSEC);
+    }
 }
 
 int command_main(int argc, char *argv[])
@@ -49,6 +79,14 @@ int command_main(int argc, char *argv[])
             // 受信した文字列をそのまま出力する
             send_write(p + 4);
             send_write("\n");
+        } else if (!strncmp(p, "mem", 3)) {
+            // mem コマンドの処理
+            // 解放されていないメモリをスレッドごとに表示する
+            kz_kmreport();
+        } else if (!strncmp(p, "stack", 5)) {
+            // stack コマンドの処理
+            // スレッドごとのスタックの使用量を表示する
+            kz_stkreport();
         } else {
             send_write("unknown.\n");
         }
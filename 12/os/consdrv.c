@@ -6,58 +6,116 @@
 #include "lib.h"
 #include "consdrv.h"
 
-#define CONS_BUFFER_SIZE 24
+// 一度のシステムコールでまとめて受信するメッセージの最大数
+#define CONS_RECV_BATCH 4
+
+// 送受信バッファ(リングバッファ)
+// 先頭の位置とデータの数で管理するので、1文字の出し入れはバッファの大きさによらず一定時間で済む
+// サイズは2のべき乗にして、位置の折り返しはマスクで計算する
+struct consbuf {
+    char *buf;
+    int size;   // バッファのサイズ
+    int head;   // 先頭のデータの位置
+    int len;    // バッファ中のデータサイズ
+};
+
+// 送受信バッファのサイズの既定値(2のべき乗にすること)
+// コンパイル時に -DCONS_SEND_BUFFER_SIZE=... などで変更できる
+// 受信バッファは1行分(改行まで)の文字をためる
+#ifndef CONS_SEND_BUFFER_SIZE
+#define CONS_SEND_BUFFER_SIZE 128
+#endif
+#ifndef CONS_RECV_BUFFER_SIZE
+#define CONS_RECV_BUFFER_SIZE 64
+#endif
+
+// デバイスごとの送受信バッファのサイズ(2のべき乗にすること)
+static const struct {
+    int send_size;
+    int recv_size;
+} consconf[CONSDRV_DEVICE_NUM] = {
+    { CONS_SEND_BUFFER_SIZE, CONS_RECV_BUFFER_SIZE },
+};
 
 // (シリアルポートではなく)コンソールを管理するための構造体
 static struct consreg {
     kz_thread_id_t id;  // コンソールを利用するスレッド
     int index;          // 利用するシリアルの番号(0-2)
 
-    char *send_buf;     // 送信バッファ
-    char *recv_buf;     // 受信バッファ
-    int send_len;       // 送信バッファ中のデータサイズ
-    int recv_len;       // 受信バッファ中のデータサイズ
-
-    long dummy[3];
+    struct consbuf send;    // 送信バッファ
+    struct consbuf recv;    // 受信バッファ
 } consreg[CONSDRV_DEVICE_NUM];
 
-// send_char と send_string は割込みハンドラとスレッドの両方から呼ばれる実装になっている
+// リングバッファの末尾に1文字追加する(一杯なら -1 を返す)
+static int consbuf_put(struct consbuf *cb, char c)
+{
+    if (cb->len == cb->size)
+        return -1;
+    cb->buf[(cb->head + cb->len) & (cb->size - 1)] = c;
+    cb->len++;
+    return 0;
+}
+
+// リングバッファの先頭から1文字取り出す(空の場合は呼ばないこと)
+static char consbuf_get(struct consbuf *cb)
+{
+    char c = cb->buf[cb->head];
+    cb->head = (cb->head + 1) & (cb->size - 1);
+    cb->len--;
+    return c;
+}
+
+// send_chars と send_string は割込みハンドラとスレッドの両方から呼ばれる実装になっている
 // 共通の資源である送信バッファを操作しているので、割込み禁止状態で呼び出して排他制御する
 
-// 送信バッファの先頭1文字を送信
-static void send_char(struct consreg *cons)
+// 送信バッファの文字を、送信データレジスタが空いている限り続けて送信する
+// SCI には FIFO がないが、送信シフトレジスタが空なら TDR はすぐに空くので、
+// 送信開始時や割込みの処理が遅れたときは1回で2文字以上を詰められる
+// 送信バッファが空になったら送信割込みを止め、最後の1文字が送り出されるのを
+// 送信完了割込みで待つ(TIE を有効のままにすると、空の TDR で割込みが続けて発生する)
+static void send_chars(struct consreg *cons)
 {
-    int i;
-    serial_send_byte(cons->index, cons->send_buf[0]);
-    // 1文字分前につめる
-    cons->send_len--;
-    for (i = 0; i < cons->send_len; i++)
-        cons->send_buf[i] = cons->send_buf[i + 1];
+    while (cons->send.len && serial_is_send_enable(cons->index))
+        serial_send_byte(cons->index, consbuf_get(&cons->send));
+
+    if (!cons->send.len) {
+        serial_intr_send_disable(cons->index);
+        serial_intr_send_end_enable(cons->index);
+    }
 }
 
 // 文字列を送信バッファに書き込み、送信を開始する
-static void send_string(struct consreg *cons, char *str, int len)
+// 送信バッファが一杯になったらそこで書き込みをやめ、書き込めた文字数を返す
+// (バッファの外を書き換えることはない)
+static int send_string(struct consreg *cons, char *str, int len)
 {
-    int i;
+    int i, need;
 
     // 改行コードを変換しつつ、受け取った文字列を送信バッファにコピー
     for (i = 0; i < len; i++) {
+        // 改行は "\r\n" の2文字になるので、2文字分の空きがなければ書き込まない
+        need = (str[i] == '\n') ? 2 : 1;
+        if (cons->send.size - cons->send.len < need)
+            break;
         if (str[i] == '\n')
-            cons->send_buf[cons->send_len++] = '\r';
-        cons->send_buf[cons->send_len++] = str[i];
+            consbuf_put(&cons->send, '\r');
+        consbuf_put(&cons->send, str[i]);
     }
 
-    // 送信割込みを有効にしたあと、最初の一文字を送信して文字列の送信を開始
-    // 2文字目以降は送信完了の割込みで起こされるハンドラ内で送信される
-    // 1文字目の送信を開始する前に送信割込みを有効化し、
-    // すべての文字の送信が終わると送信割込みを無効にするので、
-    // 送信割込みが無効の場合は送信処理を行っていない
+    // 送信割込みを有効にしたあと、送れるだけ送信して文字列の送信を開始
+    // 残りは TDR が空いたときの送信割込みで起こされるハンドラ内で送信される
+    // 送信バッファが空になると送信割込みを無効にするので、
+    // 送信割込みが無効の場合は送信バッファの文字を送り出す処理を行っていない
+    // (送信完了を待っている間に呼ばれた場合は、送信割込みを有効にし直して続けて送る)
     // まだ送信していない文字列が残っているときに send_string が呼ばれると
     // 上のループで末尾に追記されるだけで特に処理は行わない
-    if (cons->send_len && !serial_intr_is_send_enable(cons->index)) {
+    if (cons->send.len && !serial_intr_is_send_enable(cons->index)) {
+        serial_intr_send_end_disable(cons->index);
         serial_intr_send_enable(cons->index);
-        send_char(cons);
+        send_chars(cons);
     }
+
+    return i;
 }
 
 // コンソールドライバの割込みハンドラの処理内容
@@ -71,6 +129,7 @@ static int consdrv_intrproc(struct consreg *cons)
 {
     unsigned char c;
     char *p;
+    int i, len;
 
     // 受信割込みの処理
     // serial_is_recv_enable は、文字が受信できる状態になると true になる
@@ -86,31 +145,39 @@ static int consdrv_intrproc(struct consreg *cons)
         if (cons->id) {
             if (c != '\n') {
                 // 受信したものが改行文字でなければ受信バッファに入れる
-                cons->recv_buf[cons->recv_len++] = c;
+                // 受信バッファが一杯なら、入りきらない文字は捨てる
+                consbuf_put(&cons->recv, c);
             } else {
                 // 改行文字がきたらバッファの内容をコマンド処理スレッドに通知する
                 // システムコールではなくサービスコールを使っていることに注意
-                p = kx_kmalloc(CONS_BUFFER_SIZE);
-                memcpy(p, cons->recv_buf, cons->recv_len);
-                kx_send(MSGBOX_ID_CONSINPUT, cons->recv_len, p);
-                // 受信バッファをクリア
-                cons->recv_len = 0;
+                // 受信側で末尾に '\0' を書き込めるように1バイト余分に確保する
+                // メモリが確保できないときや、メッセージボックスが一杯で
+                // 送れないときは、その行は捨てる
+                len = cons->recv.len;
+                p = kx_kmalloc(len + 1);
+                for (i = 0; i < len; i++) {
+                    c = consbuf_get(&cons->recv);
+                    if (p)
+                        p[i] = c;
+                }
+                if (p && (kx_send(MSGBOX_ID_CONSINPUT, len, p) < 0))
+                    kx_kmfree(p);
             }
         }
     }
 
     // 送信割込みの処理
     // serial_is_send_enable は、送信が可能な状態になると true になる
-    if (serial_is_send_enable(cons->index)) {
-        // シリアルを使うスレッドがいない、もしくはデータがないならば送信処理を終了
-        if (!cons->id || !cons->send_len) {
-            // これ以降、送信割込みは受け取らない(そもそも送信しないので発生しないはず)
-            serial_intr_send_disable(cons->index);
-        } else {
-            // 送信データがあるならば1文字送信する
-            send_char(cons);
-        }
-    }
+    // 1回の割込みで、TDR が空いている限り続けて送信する
+    if (serial_intr_is_send_enable(cons->index) &&
+        serial_is_send_enable(cons->index))
+        send_chars(cons);
+
+    // 送信完了割込みの処理
+    // 最後の1文字まで送り出して回線が空いたので、送信完了割込みを止める
+    if (serial_intr_is_send_end_enable(cons->index) &&
+        serial_is_send_end(cons->index))
+        serial_intr_send_end_disable(cons->index);
 
     return 0;
 }
@@ -125,6 +192,7 @@ static void consdrv_intr(void)
     for (i = 0; i < CONSDRV_DEVICE_NUM; i++) {
         cons = &consreg[i];
         if (cons->id){
+            // 送信完了(TEND)のときは TDRE も立っているので、送信完了割込みもここで拾える
             if (serial_is_send_enable(cons->index) ||
                 serial_is_recv_enable(cons->index))
                 consdrv_intrproc(cons);
@@ -142,29 +210,46 @@ static int consdrv_init(void)
 static int consdrv_command(struct consreg *cons, kz_thread_id_t id,
                            int index, int size, char *command)
 {
+    int ret;
+
     // 受信したデータの最初の1文字がコマンド
     switch (command[0]) {
     // コンソールドライバの使用を開始
     case CONSDRV_CMD_USE:
+        // 送受信バッファはデバイスごとに決めたサイズで確保する
+        cons->send.size = consconf[index].send_size;
+        cons->recv.size = consconf[index].recv_size;
+        cons->send.buf = kz_kmalloc(cons->send.size);
+        cons->recv.buf = kz_kmalloc(cons->recv.size);
+        // バッファが確保できなければコンソールは使えない
+        if (!cons->send.buf || !cons->recv.buf) {
+            kz_kmfree(cons->send.buf);
+            kz_kmfree(cons->recv.buf);
+            cons->send.buf = cons->recv.buf = NULL;
+            return CONSDRV_REPLY_ERROR;
+        }
         // このドライバを使うスレッドの ID を控える
         cons->id = id;
         // 2文字目にASCII文字として使うシリアルの番号が書かれている
         cons->index = command[1] - '0';
-        cons->send_buf = kz_kmalloc(CONS_BUFFER_SIZE);
-        cons->recv_buf = kz_kmalloc(CONS_BUFFER_SIZE);
-        cons->send_len = 0;
-        cons->recv_len = 0;
+        cons->send.head = cons->send.len = 0;
+        cons->recv.head = cons->recv.len = 0;
         serial_init(cons->index);
         // シリアル受信割込みを有効化する
         serial_intr_recv_enable(cons->index);
         break;
     // コンソールへの文字列出力
+    // 送信バッファに書き込めた文字数を返す
     case CONSDRV_CMD_WRITE:
+        // 使用を開始していなければ書き込めない
+        // (0 を返すと、書き込めるようになるまで送り直しが続いてしまう)
+        if (!cons->send.buf)
+            return CONSDRV_REPLY_ERROR;
         // send_string を使うため、割込み禁止にして排他する
         INTR_DISABLE;
-        send_string(cons, command + 1, size - 1);
+        ret = send_string(cons, command + 1, size - 1);
         INTR_ENABLE;
-        break;
+        return ret;
     default:
         break;
     }
@@ -177,8 +262,8 @@ static int consdrv_command(struct consreg *cons, kz_thread_id_t id,
 // p[2] に入っているのは使うシリアルポートの番号
 int consdrv_main(int argc, char *argv[])
 {
-    int size, index;
-    kz_thread_id_t id;
+    int i, n, index, ret;
+    kz_msg_t msgs[CONS_RECV_BATCH];
     char *p;
 
     consdrv_init();
@@ -191,13 +276,23 @@ int consdrv_main(int argc, char *argv[])
         // 3文字目は使うシリアルポートの番号
         // 本文では INPUT となっているが OUTPUT の間違い
         // コマンドスレッドからメッセージを受け取って処理する
-        id = kz_recv(MSGBOX_ID_CONSOUTPUT, &size, &p);
-        index = p[0] - '0';
-        // 指定されたシリアルデバイスで受け取ったコマンドを処理
-        consdrv_command(&consreg[index], id, index, size - 1, p + 1);
+        // たまっているメッセージはまとめて受信し、システムコールの回数を減らす
+        n = kz_recv_many(MSGBOX_ID_CONSOUTPUT, msgs, CONS_RECV_BATCH);
+        for (i = 0; i < n; i++) {
+            p = msgs[i].p;
+            index = p[0] - '0';
+            // 指定されたシリアルデバイスで受け取ったコマンドを処理
+            ret = consdrv_command(&consreg[index], msgs[i].sender, index,
+                                  msgs[i].size - 1, p + 1);
+
+            // コマンドスレッドで malloc し、こちらで free する
+            kz_kmfree(p);
 
-        // コマンドスレッドで malloc し、こちらで free する
-        kz_kmfree(p);
+            // コマンドスレッドは kz_call で処理の完了を待っているので返信する
+            // 返信のサイズで処理結果(WRITE なら書き込めた文字数)を返す
+            // 失敗したときも p はここで解放済みなので、CONSDRV_REPLY_ERROR を返す
+            kz_reply(msgs[i].sender, ret, NULL);
+        }
     }
 
     return 0;
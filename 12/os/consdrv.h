@@ -5,4 +5,9 @@
 #define CONSDRV_CMD_USE   'u'
 #define CONSDRV_CMD_WRITE 'w'
 
+// コマンドの処理に失敗したときの返信のサイズ
+// kz_call 自体の失敗(-1)と区別できるように負の値は使わず、
+// WRITE で書き込めた文字数とも重ならない値にする
+#define CONSDRV_REPLY_ERROR 0x7fff
+
 #endif
@@ -3,12 +3,18 @@
 
 #define NULL ((void *)0)
 #define SERIAL_DEFAULT_DEVICE 1
+#define CPU_CLOCK 20000000 // CPU のクロック周波数(20MHz)
+#define SERIAL_DEFAULT_BAUDRATE 9600
 
 typedef unsigned char   uint8;
 typedef unsigned short  uint16;
 typedef unsigned long   uint32;
 
 typedef uint32 kz_thread_id_t;
+// 割込みハンドラ(サービスコール)から送信したメッセージの送信元の ID
+// スレッドID は 0 にも、下位8ビットが 0 にもならないので、スレッドの ID と重ならない
+// (受信時の 0 はタイムアウトやメッセージがないことを表す)
+#define KZ_THREAD_ID_INTR ((kz_thread_id_t)0xffffff00)
 typedef int (*kz_func_t)(int argc, char *argv[]);
 typedef void (*kz_handler_t)(void);
 
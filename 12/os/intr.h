@@ -3,10 +3,11 @@
 
 /* ソフトウェア割り込みベクタの定義 */
 
-#define SOFTVEC_TYPE_NUM        3   // 用意する割込みハンドラの数
+#define SOFTVEC_TYPE_NUM        4   // 用意する割込みハンドラの数
 
 #define SOFTVEC_TYPE_SOFTERR    0   // ソフトウェアエラー
 #define SOFTVEC_TYPE_SYSCALL    1   // システムコール
 #define SOFTVEC_TYPE_SERINTR    2   // シリアル割込み
+#define SOFTVEC_TYPE_TIMINTR    3   // タイマ割込み
 
 #endif
\ No newline at end of file
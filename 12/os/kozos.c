@@ -4,14 +4,67 @@
 #include "interrupt.h"
 #include "syscall.h"
 #include "memory.h"
+#include "stack.h"
+#include "timer.h"
 #include "lib.h"
 
 // TCB(task control block)の数
-#define THREAD_NUM 6
+// コンパイル時に -DTHREAD_NUM=... で変更できる(スレッドID の都合で最大 255)
+// TCB は1つ 90 バイトほどあり、bss に置かれて freearea(メモリプールとヒープ領域)を
+// その分だけ狭くする。RAM は 16KB しかないので、使う分だけにしておく
+// (増やしすぎてプールが収まらなくなれば、ld.scr の ASSERT でリンクがエラーになる)
+#ifndef THREAD_NUM
+#define THREAD_NUM 8
+#endif
 // 優先度の個数
 #define PRIORITY_NUM  16
 #define THREAD_NAME_SIZE 15
 
+// メッセージボックスひとつにためておけるメッセージの数(2のべき乗にすること)
+// コンパイル時に -DMSGBOX_MSG_NUM=... で変更できる
+#ifndef MSGBOX_MSG_NUM
+#define MSGBOX_MSG_NUM 8
+#endif
+
+// タイムスライスに使うタイマのチャネルと、タイマ割込みの周期(マイクロ秒)
+#define TIMESLICE_TIMER_INDEX 0
+#define TIMESLICE_TICK_USEC   10000
+
+// 時間待ち(kz_sleep_ms, kz_recv_timeout)に使うタイマのチャネル
+// タイマは一定周期では動かさず、一番近い期限に合わせてその都度セットする
+// 16 ビットタイマで一度に計れる時間には上限があるので、長い待ち時間は分割して計る
+#define TIMEOUT_TIMER_INDEX 1
+#define TIMEOUT_MAX_USEC    20000
+
+// 優先度ごとのタイムスライス(タイマ割込みの回数)
+// 同じ優先度のスレッドが複数動作可能なとき、この回数だけタイマ割込みが入ったら
+// 実行中のスレッドをキューの末尾に回して次のスレッドに切り替える
+// 0 の優先度ではタイマによる切り替えは行わない
+// (優先度 0 のスレッドは割込み禁止で動くので、そもそもタイマ割込みが入らない)
+static const uint8 timeslice[PRIORITY_NUM] = {
+    0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2
+};
+
+// スタックの検査
+// スタックは確保したときに KZ_STACK_FILL で埋めておき、どこまで書き換えられたかで
+// 使用量の最大値(ハイウォーターマーク)を求める
+// コンパイル時に -DKZ_STACK_CHECK を指定すると、スタックの下端にカナリアを置き、
+// スレッドが切り替わるたびにスタックあふれを検査する
+#define KZ_STACK_FILL   0xaa
+#ifdef KZ_STACK_CHECK
+#define KZ_STACK_CANARY 0x5a5aa5a5UL
+#define KZ_STACK_CANARY_SIZE ((int)sizeof(uint32))
+#else
+#define KZ_STACK_CANARY_SIZE 0
+#endif
+
+// スレッドID は下位8ビットが TCB の番号(1始まり)、その上が TCB の世代番号
+// TCB が再利用されると世代番号が変わるので、終了したスレッドの古い ID は無効になる
+// 番号を1始まりにしているのは、ID が 0 にならないようにするため
+#define THREAD_ID_INDEX_MASK 0xff
+#define THREAD_ID(index, generation) \
+    (((kz_thread_id_t)(generation) << 8) | ((index) + 1))
+
 
 // スレッドコンテキスト
 // コンテキストの中身はスタックポインタのみ(汎用レジスタは各スタック内に保存されるため)
@@ -19,17 +72,45 @@ typedef struct _kz_context {
     uint32 sp;
 } kz_context;
 
+// kz_kmalloc で確保したまま、まだ解放されていないメモリの量
+typedef struct _kz_memcount {
+    int blocks;     // ブロックの数
+    long bytes;     // ブロックのサイズの合計(ヘッダを含む)
+} kz_memcount;
+
 // タスクコントロールブロック(TCB)
 // タスクの情報を保持する構造体で、すべてのタスクがつながったリスト構造を取る
 typedef struct _kz_thread {
+    // レディーキューにつながっているときはキューの次の TCB
+    // 受信待ちのときはメッセージボックスの受信待ちキューの次の TCB
+    // 未使用の TCB のときは空き TCB リストの次の TCB
     struct _kz_thread *next;
+    kz_thread_id_t id;  // スレッドID
+    uint16 generation;  // TCB の世代番号(TCB を解放するたびに増える)
     char name[THREAD_NAME_SIZE + 1];
-    int priority;
-    char *stack;
+    int priority;       // 実際にスケジューリングに使う優先度
+    int base_priority;  // kz_run, kz_chpri で指定された本来の優先度
+    // サーバモードのメッセージボックスで引き継いだ優先度(なければ PRIORITY_NUM)
+    int inherit;
+    // このスレッドがサーバになっているメッセージボックス
+    struct _kz_msgbox *served;
+    char *stack;        // スタックの上端
+    int stacksize;      // スタックのサイズ
 
     // 各種フラグ
     uint32 flags;
-    #define KZ_THREAD_FLAG_READY (1 << 0)
+    #define KZ_THREAD_FLAG_READY   (1 << 0)
+    #define KZ_THREAD_FLAG_TIMEOUT (1 << 1) // タイマキューにつながっている
+
+    // 時間待ちのためのタイマキューのリンクと、前の要素の期限からの待ち時間(マイクロ秒)
+    struct {
+        struct _kz_thread *next;
+        long delta;
+    } timeout;
+
+    // このスレッドが確保して、まだ解放されていないメモリ
+    // 他のスレッドが解放した場合も、確保したスレッドの分から差し引く
+    kz_memcount kmem;
 
     // スレッドのスタートアップ(thread_init)に渡すパラメータ
     struct {
@@ -51,10 +132,10 @@ typedef struct _kz_thread {
 } kz_thread;
 
 typedef struct _kz_msgbuf {
-    // ひとつのボックスに複数のメッセージがぶら下げられるようにリンク構造にする
-    struct _kz_msgbuf *next;
     // メッセージを送ったスレッドの ID を控えておく
-    kz_thread *sender;
+    kz_thread_id_t sender;
+    // 送信元の優先度(サーバモードの優先度継承に使う)
+    int priority;
     // メッセージの中身
     struct {
         int size;
@@ -63,12 +144,17 @@ typedef struct _kz_msgbuf {
 } kz_msgbuf;
 
 typedef struct _kz_msgbox {
-    // 受信待ちのスレッドを覚えておく
+    // 受信待ちのスレッドのキュー(待ち始めた順)
     kz_thread *receiver;
-    kz_msgbuf *head;
-    kz_msgbuf *tail;
-
-    long dummy[1];
+    kz_thread *receiver_tail;
+    // サーバモードのときに受信するスレッド(サーバモードでなければ NULL)
+    // サーバは送信元のうち最も高い優先度を引き継いで動作する
+    kz_thread *server;
+    // メッセージはボックス内の固定長のリングバッファにためる
+    // 送受信のたびにメモリを確保・解放しなくて済む
+    int head;   // 先頭のメッセージの位置
+    int num;    // たまっているメッセージの数
+    kz_msgbuf msgs[MSGBOX_MSG_NUM];
 } kz_msgbox;
 
 // OS が管理するスレッドのレディーキュー
@@ -78,16 +164,50 @@ static struct {
     kz_thread *tail;
 } readyque[PRIORITY_NUM];
 
+// 割込み処理の間にレディーキューが変化したか
+// 変化していなければ割込まれたスレッドがそのまま動き続けるので、スケジューリングを省略できる
+static int readyque_changed;
+
+// レディーキューが空でない優先度のビットマップ
+// ビット i が立っていれば readyque[i] にスレッドがつながっている
+// PRIORITY_NUM が 16 なので 16 ビットで足りる
+static uint16 readyque_bitmap;
+
+// 4ビット値の中で最も下位にある 1 のビット位置
+// H8/300H にはビット探索命令(CLZ など)がないので表引きで求める
+static const uint8 readyque_lsb[16] = {
+    0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
 // 現在実行中のスレッド
 static kz_thread *current;
 // TCB の実体
 static kz_thread threads[THREAD_NUM];
+// 未使用の TCB のリスト
+static kz_thread *freethreads;
 // 割込みハンドラ
 static kz_handler_t handlers[SOFTVEC_TYPE_NUM];
 
+// 終了したスレッドが確保したまま解放されていないメモリ
+static kz_memcount kmem_exited;
+// 割込みハンドラ(サービスコール)で確保して、まだ解放されていないメモリ
+static kz_memcount kmem_intr;
+
 // メッセージボックス(メッセージID 1つにつき1つ)
 static kz_msgbox msgboxes[MSGBOX_ID_NUM];
 
+// タイムスライスを消費中のスレッドと、消費したタイマ割込みの回数
+static kz_thread *slice_thread;
+static int slice_count;
+// タイムスライス用のタイマが動いているか
+static int slice_timer;
+
+// 時間待ちをしているスレッドのキュー(期限の近い順)
+// 各スレッドの待ち時間は、ひとつ前のスレッドの期限からの差分で持つ
+static kz_thread *timeque;
+// タイマにセットしている時間(0 ならタイマは止まっている)
+static long timeque_programmed;
+
 // プロトタイプ宣言のみ
 void dispatch(kz_context *context);
 
@@ -109,11 +229,14 @@ static int getcurrent(void)
     if (readyque[current->priority].head == NULL) {
         // キューが空になった場合は tail も null にする
         readyque[current->priority].tail = NULL;
+        // ビットマップからも外す
+        readyque_bitmap &= ~(1 << current->priority);
     }
 
     // タスクをキューから外すときに READY ビットを落とす
     current->flags &= ~KZ_THREAD_FLAG_READY;
     current->next = NULL;
+    readyque_changed = 1;
 
     return 0;
 }
@@ -136,12 +259,239 @@ static int putcurrent(void)
         readyque[current->priority].head = current;
     }
     readyque[current->priority].tail = current;
+    readyque_bitmap |= (1 << current->priority);
     // タスクをキューに戻すときに READY ビットを立てる
     current->flags |= KZ_THREAD_FLAG_READY;
+    readyque_changed = 1;
+
+    return 0;
+}
+
+// 指定したスレッドを、同じ優先度のキューの先頭につなげる
+// kz_call, kz_reply で相手のスレッドに直接処理を渡すために使う
+// 相手が動作可能なスレッドの中で最も優先度が高ければ、同じ優先度の他のスレッドを
+// 待たずに、次の schedule でそのまま選ばれる
+static int puthead(kz_thread *thp)
+{
+    if (thp->flags & KZ_THREAD_FLAG_READY)
+        return 1;
+
+    thp->next = readyque[thp->priority].head;
+    readyque[thp->priority].head = thp;
+    if (readyque[thp->priority].tail == NULL)
+        readyque[thp->priority].tail = thp;
+    readyque_bitmap |= (1 << thp->priority);
+    thp->flags |= KZ_THREAD_FLAG_READY;
+    readyque_changed = 1;
+
+    return 0;
+}
+
+// 指定したスレッドをキューの途中から外す
+static void readyque_remove(kz_thread *thp)
+{
+    kz_thread **tpp, *prev = NULL;
+
+    for (tpp = &readyque[thp->priority].head; *tpp; tpp = &(*tpp)->next) {
+        if (*tpp == thp) {
+            *tpp = thp->next;
+            if (readyque[thp->priority].tail == thp)
+                readyque[thp->priority].tail = prev;
+            if (readyque[thp->priority].head == NULL)
+                readyque_bitmap &= ~(1 << thp->priority);
+            break;
+        }
+        prev = *tpp;
+    }
+
+    thp->flags &= ~KZ_THREAD_FLAG_READY;
+    thp->next = NULL;
+    readyque_changed = 1;
+}
+
+// 動作可能なスレッドがつながっている最も優先度の高いキューの番号を返す
+// ループを使わず表引きで求めるので、優先度によらず一定時間で終わる
+static int readyque_first(void)
+{
+    uint16 bitmap = readyque_bitmap;
+    int n = 0;
+
+    // 下位8ビット、下位4ビットの順に絞り込み、最後の4ビットは表引き
+    if (!(bitmap & 0xff)) {
+        bitmap >>= 8;
+        n += 8;
+    }
+    if (!(bitmap & 0x0f)) {
+        bitmap >>= 4;
+        n += 4;
+    }
+
+    return n + readyque_lsb[bitmap & 0x0f];
+}
+
+// ---------------------- タイマキューの操作 ----------------------
+// タイマにセットしてからの経過時間を、キューの先頭の待ち時間から差し引いてタイマを止める
+static void timeque_update(void)
+{
+    long elapsed;
+
+    if (!timeque_programmed)
+        return;
+
+    if (timer_is_expired(TIMEOUT_TIMER_INDEX))
+        elapsed = timeque_programmed;
+    else
+        elapsed = timer_gettime(TIMEOUT_TIMER_INDEX);
+    timer_cancel(TIMEOUT_TIMER_INDEX);
+    timeque_programmed = 0;
+
+    if (timeque)
+        timeque->timeout.delta -= elapsed;
+}
+
+// キューの先頭の期限に合わせてタイマをセットする
+// 一定周期のタイマ割込みは使わないので、時間待ちがなければタイマは止まったまま
+static void timeque_program(void)
+{
+    long usec;
+
+    if (timeque == NULL)
+        return;
+
+    usec = timeque->timeout.delta;
+    if (usec > TIMEOUT_MAX_USEC)
+        usec = TIMEOUT_MAX_USEC;
+    if (usec < 1)
+        usec = 1;
+
+    timer_start(TIMEOUT_TIMER_INDEX, usec);
+    timeque_programmed = usec;
+}
+
+// スレッドを usec マイクロ秒後に期限を迎えるようにタイマキューにつなぐ
+static void timeque_add(kz_thread *thp, long usec)
+{
+    kz_thread **tpp;
+
+    timeque_update();
+
+    // 前から順に期限を差し引いていき、挿入位置を探す
+    for (tpp = &timeque; *tpp; tpp = &(*tpp)->timeout.next) {
+        if (usec < (*tpp)->timeout.delta) {
+            // 後ろのスレッドの待ち時間は、挿入したスレッドの期限からの差分にする
+            (*tpp)->timeout.delta -= usec;
+            break;
+        }
+        usec -= (*tpp)->timeout.delta;
+    }
+    thp->timeout.delta = usec;
+    thp->timeout.next = *tpp;
+    *tpp = thp;
+    thp->flags |= KZ_THREAD_FLAG_TIMEOUT;
+
+    timeque_program();
+}
+
+// スレッドをタイマキューから外す(期限の前に待ちが解除された場合)
+// 先頭を外した場合でもタイマはそのままにしておく
+// 割込みが早めに入るだけで、そのときにタイマがセットし直される
+static void timeque_remove(kz_thread *thp)
+{
+    kz_thread **tpp;
+
+    if (!(thp->flags & KZ_THREAD_FLAG_TIMEOUT))
+        return;
+
+    for (tpp = &timeque; *tpp; tpp = &(*tpp)->timeout.next) {
+        if (*tpp == thp) {
+            *tpp = thp->timeout.next;
+            // 外したスレッドの待ち時間は後ろのスレッドに引き継ぐ
+            if (*tpp)
+                (*tpp)->timeout.delta += thp->timeout.delta;
+            break;
+        }
+    }
+    thp->timeout.next = NULL;
+    thp->flags &= ~KZ_THREAD_FLAG_TIMEOUT;
+}
+
+// ---------------------- スレッドID の変換 ----------------------
+// スレッドID から TCB を引く
+// ID から TCB の番号を取り出して直接参照するので探索は不要
+// 未使用の TCB や、世代番号が一致しない(終了したスレッドの)ID には NULL を返す
+static kz_thread *thread_lookup(kz_thread_id_t id)
+{
+    // ID が 0 の場合は符号なしの引き算で大きな値になり、範囲外として弾かれる
+    unsigned int index = (unsigned int)(id & THREAD_ID_INDEX_MASK) - 1;
+    kz_thread *thp;
+
+    if (index >= THREAD_NUM)
+        return NULL;
+
+    thp = &threads[index];
+    if (!thp->init.func || (thp->id != id))
+        return NULL;
+
+    return thp;
+}
+
+// ---------------------- スタックの検査 ----------------------
+// スタックの使用量の最大値を返す
+// 下端から KZ_STACK_FILL のまま残っている部分は一度も使われていない
+static int stack_used(kz_thread *thp)
+{
+    char *p = thp->stack - thp->stacksize + KZ_STACK_CANARY_SIZE;
+
+    while ((p < thp->stack) && (*p == (char)KZ_STACK_FILL))
+        p++;
+
+    return thp->stack - p;
+}
+
+// スレッドごとにスタックのサイズと使用量の最大値を表示する
+// スタックを小さくしてよいかどうかの目安にする
+static int thread_stkreport(void)
+{
+    int i;
 
+    for (i = 0; i < THREAD_NUM; i++) {
+        if (!threads[i].init.func)
+            continue;
+        puts(threads[i].name);
+        puts(": ");
+        putxval(stack_used(&threads[i]), 0);
+        puts("/");
+        putxval(threads[i].stacksize, 0);
+        puts(" bytes\n");
+    }
+
+    // スタック領域全体で同時に確保したサイズの最大値
+    // スレッドのスタック領域(userstack)の大きさを決める目安にする
+    puts("stack area max used: ");
+    putxval(kzstack_maxused(), 0);
+    puts(" bytes\n");
+
+    putcurrent();
     return 0;
 }
 
+#ifdef KZ_STACK_CHECK
+// スタックあふれの検査
+// スタックポインタが下端を越えているか、下端のカナリアが書き換えられていればあふれている
+// 隣のスタックを壊している可能性があるので、そのまま動かし続けずに停止する
+static void stack_check(kz_thread *thp, unsigned long sp)
+{
+    char *bottom = thp->stack - thp->stacksize;
+
+    if ((sp < (unsigned long)bottom + KZ_STACK_CANARY_SIZE) ||
+        (*(uint32 *)bottom != KZ_STACK_CANARY)) {
+        puts(thp->name);
+        puts(" STACK OVERFLOW\n");
+        kz_sysdown();
+    }
+}
+#endif
+
 // ---------------------- スレッドの起動・終了 ----------------------
 // thread_* と kz_* の関係がよくわからない…
 // thread_end の存在価値は…？ → スレッドの終了と OS としてのタスクの終了は別の概念
@@ -176,38 +526,60 @@ static void thread_init(kz_thread *thp)
 static kz_thread_id_t thread_run(kz_func_t func, char *name, int priority,
                                  int stacksize, int argc, char *argv[])
 {
-    int i;
     kz_thread *thp;
     uint32 *sp;
-    extern char userstack;  // リンカスクリプトで定義されたアドレス
-    static char *thread_stack = &userstack;
+    char *stack;
+    uint16 generation;
 
-    // 未使用の TCB を探索
-    for (i = 0; i < THREAD_NUM; i++) {
-        thp = &threads[i];
-        if (!thp->init.func)
-            break;
-    }
+    // 空き TCB リストの先頭から未使用の TCB を取得
+    thp = freethreads;
     // TCB の空きがなければ終了
-    if (i == THREAD_NUM)
+    // 呼び出したスレッドはレディーキューに戻しておく
+    if (thp == NULL) {
+        putcurrent();
+        return -1;
+    }
+
+    // OS がスタック用に管理する領域から、要求された分だけスタックを確保
+    // サイズが 0 以下ならエラー
+    stack = kzstack_alloc(stacksize);
+    if (stack == NULL) {
+        putcurrent();
         return -1;
+    }
+    // スタックのサイズは確保した大きさ(8 バイト単位に切り上げたもの)にする
+    // 奇数のままだと、スタックの上端(スタックポインタの初期値)が奇数アドレスになる
+    // 確保できたのでスタック領域より小さく、int に収まる
+    stacksize = kzstack_round(stacksize);
+
+    freethreads = thp->next;
 
+    // 世代番号だけは残して TCB をクリアする
+    generation = thp->generation;
     memset(thp, 0, sizeof(*thp));
+    thp->generation = generation;
 
     // TCB に情報を設定
+    thp->id = THREAD_ID(thp - threads, generation);
     strcpy(thp->name, name);
     thp->next      = NULL;
     thp->priority  = priority;
+    thp->base_priority = priority;
+    thp->inherit   = PRIORITY_NUM;
     thp->flags     = 0; // 初期値では READY 状態ではない
     thp->init.func = func;
     thp->init.argc = argc;
     thp->init.argv = argv;
 
-    // OS がスタック用に管理する領域から、要求された分だけスタックを確保して割当て
-    memset(thread_stack, 0, stacksize);
-    thread_stack += stacksize;
-    // 確保したスタックのアドレスを TCB にセット
-    thp->stack = thread_stack;
+    // 確保したスタックを割当て
+    // スタックは上端から下に伸びるので、TCB には上端のアドレスをセットする
+    // 使用量を計れるように、スタックは 0 ではなく KZ_STACK_FILL で埋めておく
+    memset(stack, KZ_STACK_FILL, stacksize);
+#ifdef KZ_STACK_CHECK
+    *(uint32 *)stack = KZ_STACK_CANARY;
+#endif
+    thp->stack = stack + stacksize;
+    thp->stacksize = stacksize;
 
     // タスクを実行する前にスタックにデータを積んでおく
     sp = (uint32 *)thp->stack;
@@ -241,17 +613,41 @@ static kz_thread_id_t thread_run(kz_func_t func, char *name, int priority,
     current = thp;
     putcurrent();
 
-    return (kz_thread_id_t)current;
+    return current->id;
 }
 
 // システムコールの処理(for kz_exit: スレッド終了)
 static int thread_exit(void)
 {
+    uint16 generation;
+
     puts(current->name);
     puts(" EXIT.\n");
-
-    // TCB のみをクリア、スタックは再利用できない
+    // スタックの使用量の最大値も表示しておく
+    puts("stack used: ");
+    putxval(stack_used(current), 0);
+    puts("\n");
+
+    // スタックを返却してから TCB をクリアする
+    // システムコールの処理は割込みスタック上で動いているので、ここで返却しても問題ない
+    kzstack_free(current->stack - current->stacksize, current->stacksize);
+
+    // 解放されていないメモリは、終了したスレッドの分として引き継ぐ
+    kmem_exited.blocks += current->kmem.blocks;
+    kmem_exited.bytes  += current->kmem.bytes;
+
+    // サーバになっていたメッセージボックスはサーバモードを解除する
+    if (current->served)
+        current->served->server = NULL;
+
+    // 世代番号を進めてから TCB をクリアし、空き TCB リストに戻す
+    // 世代番号が変わるので、このスレッドの ID はこれ以降無効になる
+    generation = current->generation + 1;
     memset(current, 0, sizeof(*current));
+    current->generation = generation;
+    current->next = freethreads;
+    freethreads = current;
+
     return 0;
 }
 
@@ -272,14 +668,42 @@ static int thread_sleep(void)
     return 0;
 }
 
+// 呼び出したタスクを指定時間だけスリープ
+static int thread_sleep_ms(long msec)
+{
+    // 待ち時間が 0 以下ならスリープせずに、kz_wait と同様に処理を譲るだけにする
+    if (msec <= 0) {
+        putcurrent();
+        return 0;
+    }
+
+    // putcurrent せずにタイマキューにつなぐ
+    // 期限がきたらタイマ割込みでレディーキューに戻される
+    timeque_add(current, msec * 1000);
+    return 0;
+}
+
 // 指定したタスクを待ち状態にする
 static int thread_wakeup(kz_thread_id_t id)
 {
+    kz_thread *thp = thread_lookup(id);
+
     // wakeup を呼んだスレッドをレディーキューに戻す
     putcurrent();
 
+    // 存在しないスレッド(終了したスレッドの ID など)ならエラー
+    // kz_sleep, kz_sleep_ms で寝ているスレッド以外は起こせない
+    // (受信待ちのスレッドは受信待ちキューにつながっていて、next を共用している
+    //  レディーキューにつなぐとキューが壊れるため)
+    if ((thp == NULL) || (thp->flags & KZ_THREAD_FLAG_READY) ||
+        ((thp->syscall.type != KZ_SYSCALL_TYPE_SLEEP) &&
+         (thp->syscall.type != KZ_SYSCALL_TYPE_SLEEP_MS)))
+        return -1;
+
     // 指定されたスレッドをレディーキューに戻す(スリープから復帰)
-    current = (kz_thread *)id;
+    // kz_sleep_ms で寝ているスレッドなら、タイマキューからも外す
+    timeque_remove(thp);
+    current = thp;
     putcurrent();
 
     return 0;
@@ -289,85 +713,338 @@ static int thread_wakeup(kz_thread_id_t id)
 static kz_thread_id_t thread_getid(void)
 {
     putcurrent();
-    return (kz_thread_id_t)current;
+    return current->id;
 }
 
 // 呼び出したタスクの優先度を変更
 static int thread_chpri(int priority)
 {
-    int old = current->priority;
+    int old = current->base_priority;
     // 優先度を変更した上でレディーキューにつなぎ直す
-    if (priority >= 0)
+    // 優先度を継承しているときは、継承した優先度より下がらないようにする
+    if (priority >= 0) {
+        current->base_priority = priority;
         current->priority = priority;
+        if (current->inherit < priority)
+            current->priority = current->inherit;
+    }
     putcurrent();
     return old;
 }
 
+// ---------------------- 優先度継承 ----------------------
+// スレッドの優先度を変更する
+// レディーキューにつながっているときは、新しい優先度のキューの末尾につなぎ直す
+static void thread_setpri(kz_thread *thp, int priority)
+{
+    kz_thread *cur;
+
+    if (thp->priority == priority)
+        return;
+
+    if (!(thp->flags & KZ_THREAD_FLAG_READY)) {
+        thp->priority = priority;
+        return;
+    }
+
+    readyque_remove(thp);
+    thp->priority = priority;
+    cur = current;
+    current = thp;
+    putcurrent();
+    current = cur;
+}
+
+// サーバモードのメッセージボックスに、priority の優先度のスレッドから送信されたとき
+// サーバの優先度がそれより低ければ引き上げる
+static void server_boost(kz_msgbox *mboxp, int priority)
+{
+    kz_thread *thp = mboxp->server;
+
+    if ((thp == NULL) || (priority >= thp->inherit))
+        return;
+
+    thp->inherit = priority;
+    if (priority < thp->priority)
+        thread_setpri(thp, priority);
+}
+
+// サーバが受信した、または返信したときに、サーバの優先度を決め直す
+// held は処理中の要求(受信したメッセージ)の送信元の優先度で、要求がなければ PRIORITY_NUM
+// 次の受信か返信までは held の優先度で動作し、まだ受信していないメッセージがあれば
+// その送信元の優先度も引き継ぐ
+static void server_update(kz_msgbox *mboxp, kz_thread *thp, int held)
+{
+    kz_msgbuf *mp;
+    int i, priority;
+
+    if ((mboxp == NULL) || (mboxp->server != thp))
+        return;
+
+    for (i = 0; i < mboxp->num; i++) {
+        mp = &mboxp->msgs[(mboxp->head + i) & (MSGBOX_MSG_NUM - 1)];
+        if (mp->priority < held)
+            held = mp->priority;
+    }
+    thp->inherit = held;
+
+    priority = thp->base_priority;
+    if (held < priority)
+        priority = held;
+    thread_setpri(thp, priority);
+}
+
+// 呼び出したスレッドを、メッセージボックスのサーバにする
+static int thread_setserver(kz_msgbox_id_t id)
+{
+    kz_msgbox *mboxp = &msgboxes[id];
+
+    putcurrent();
+
+    // サーバになれるのは1つのメッセージボックスにつき1スレッド、
+    // 1スレッドにつき1つのメッセージボックスまで
+    if ((mboxp->server && (mboxp->server != current)) ||
+        (current->served && (current->served != mboxp)))
+        return -1;
+
+    mboxp->server = current;
+    current->served = mboxp;
+
+    // すでにたまっているメッセージの送信元の優先度を引き継ぐ
+    server_update(mboxp, current, PRIORITY_NUM);
+
+    return 0;
+}
+
+// ---------------------- メモリの使用量の管理 ----------------------
+// ブロックの持ち主の ID から、使用量を数えるカウンタを引く
+static kz_memcount *kmem_count(kz_thread_id_t owner)
+{
+    kz_thread *thp;
+
+    if (owner == KZMEM_OWNER_INTR)
+        return &kmem_intr;
+    thp = thread_lookup(owner);
+    // 持ち主のスレッドが終了していれば、終了したスレッドの分になっている
+    return thp ? &thp->kmem : &kmem_exited;
+}
+
 static void *thread_kmalloc(int size)
 {
+    // サービスコールの場合は current が NULL なので、割込みハンドラの分として数える
+    kz_thread_id_t owner = current ? current->id : KZMEM_OWNER_INTR;
+    kz_memcount *count;
+    void *p;
+
     putcurrent();
-    return kzmem_alloc(size);
+
+    p = kzmem_alloc(size, owner);
+    if (p) {
+        count = kmem_count(owner);
+        count->blocks++;
+        count->bytes += kzmem_size(p);
+    }
+
+    return p;
 }
 
 static int thread_kmfree(char *p)
 {
-    kzmem_free(p);
+    kz_memcount *count;
+
+    if (p) {
+        // 解放したスレッドではなく、確保したスレッドの分から差し引く
+        count = kmem_count(kzmem_owner(p));
+        count->blocks--;
+        count->bytes -= kzmem_size(p);
+        kzmem_free(p);
+    }
     putcurrent();
     return 0;
 }
 
-static void sendmsg(kz_msgbox *mboxp, kz_thread *thp, int size, char *p)
+static void kmreport_count(char *name, kz_memcount *count)
+{
+    puts(name);
+    puts(": ");
+    putxval(count->blocks, 0);
+    puts(" blocks, ");
+    putxval(count->bytes, 0);
+    puts(" bytes\n");
+}
+
+#ifdef KZMEM_DEBUG
+// メモリ管理で不正な操作を検出したときの処理(デバッグモードのみ)
+// 呼び出したスレッドの名前を表示して停止する
+// サービスコールの場合は current が NULL なので、割込みハンドラとして表示する
+void kzmem_error(char *msg, void *mem)
+{
+    puts("kzmem: ");
+    puts(msg);
+    puts(" ");
+    putxval((unsigned long)mem, 8);
+    puts(" by ");
+    puts(current ? current->name : "(intr)");
+    puts("\n");
+    kz_sysdown();
+}
+#endif
+
+// 解放されていないブロックを1つ表示する(kzmem_walk から呼ばれる)
+static void kmreport_block(void *mem, int size, kz_thread_id_t owner)
+{
+    kz_thread *thp = thread_lookup(owner);
+
+    putxval((unsigned long)mem, 8);
+    puts(" ");
+    putxval(size, 4);
+    puts(" ");
+    putxval(owner, 8);
+    puts(" ");
+    if (owner == KZMEM_OWNER_INTR)
+        puts("(intr)");
+    else
+        puts(thp ? thp->name : "(exited)");
+    puts("\n");
+}
+
+// 解放されていないメモリを、スレッドごとの合計と、ブロックごとの一覧で表示する
+// 終了したスレッドが確保したままのブロックも表示されるので、リークを探すのに使う
+// 戻り値は解放されていないブロックの数
+static int thread_kmreport(void)
+{
+    int i, n;
+
+    for (i = 0; i < THREAD_NUM; i++) {
+        if (threads[i].init.func && threads[i].kmem.blocks)
+            kmreport_count(threads[i].name, &threads[i].kmem);
+    }
+    if (kmem_exited.blocks)
+        kmreport_count("(exited)", &kmem_exited);
+    if (kmem_intr.blocks)
+        kmreport_count("(intr)", &kmem_intr);
+
+    n = kzmem_walk(kmreport_block);
+
+    putcurrent();
+    return n;
+}
+
+// thp は送信したスレッド(サービスコールの場合は NULL)
+static int sendmsg(kz_msgbox *mboxp, kz_thread *thp, int size, char *p)
 {
     kz_msgbuf *mp;
 
-    // メッセージバッファを動的に確保
-    mp = (kz_msgbuf *)kzmem_alloc(sizeof(*mp));
-    if (mp == NULL)
-        kz_sysdown();
-    
-    mp->next       = NULL;
-    mp->sender     = thp;
+    // リングバッファが一杯なら送信できない(送信側にエラーを返す)
+    if (mboxp->num == MSGBOX_MSG_NUM)
+        return -1;
+
+    // リングバッファの末尾の空きにメッセージを書き込む
+    mp = &mboxp->msgs[(mboxp->head + mboxp->num) & (MSGBOX_MSG_NUM - 1)];
+    // サービスコールの場合は送信元の ID は KZ_THREAD_ID_INTR になり、優先度は引き継がない
+    // (0 にするとタイムアウトと区別できなくなる)
+    mp->sender     = thp ? thp->id : KZ_THREAD_ID_INTR;
+    mp->priority   = thp ? thp->priority : PRIORITY_NUM;
     mp->param.size = size;
     mp->param.p    = p;
+    mboxp->num++;
+
+    // サーバモードなら、サーバに送信元の優先度を引き継ぐ
+    server_boost(mboxp, mp->priority);
+
+    return 0;
+}
 
-    // 新しく作ったバッファを末尾に接続する
-    if (mboxp->tail) {
-        mboxp->tail->next = mp;
+// 受信待ちキューの末尾にスレッドをつなぐ
+// 受信待ちのスレッドはレディーキューから外れているので、TCB の next をリンクに使う
+static void recvque_put(kz_msgbox *mboxp, kz_thread *thp)
+{
+    thp->next = NULL;
+    if (mboxp->receiver_tail) {
+        mboxp->receiver_tail->next = thp;
     } else {
-        mboxp->head = mp;
+        mboxp->receiver = thp;
     }
-    mboxp->tail = mp;
+    mboxp->receiver_tail = thp;
 }
 
-static void recvmsg(kz_msgbox *mboxp)
+// 受信待ちキューの先頭のスレッドを取り出す
+static kz_thread *recvque_get(kz_msgbox *mboxp)
 {
-    // 受信用バッファへのポインタ
-    kz_msgbuf *mp;
-    kz_syscall_param_t *p;
-
-    // メッセージボックスの先頭のメッセージバッファを取り出す
-    mp = mboxp->head;
-    // メッセージボックスが空だと NULL アクセスになるが
-    // recvmsg を呼び出す thread_recv がそうならないことを保証しているため一応問題なし
-    mboxp->head = mp->next;
-    if (mboxp->head == NULL)
-        mboxp->tail = NULL;
-    mp->next = NULL;
-
-    // 受信待ちのスレッドに値をコピーする
-    p = mboxp->receiver->syscall.param;
-    p->un.recv.ret = (kz_thread_id_t)mp->sender;
+    kz_thread *thp = mboxp->receiver;
+
+    mboxp->receiver = thp->next;
+    if (mboxp->receiver == NULL)
+        mboxp->receiver_tail = NULL;
+    // レディーキューにつなぎ直せるように next はクリアしておく
+    thp->next = NULL;
+
+    return thp;
+}
+
+// 受信待ちキューの途中からスレッドを外す(タイムアウトした場合)
+static void recvque_remove(kz_msgbox *mboxp, kz_thread *thp)
+{
+    kz_thread **tpp, *prev = NULL;
+
+    for (tpp = &mboxp->receiver; *tpp; tpp = &(*tpp)->next) {
+        if (*tpp == thp) {
+            *tpp = thp->next;
+            if (mboxp->receiver_tail == thp)
+                mboxp->receiver_tail = prev;
+            thp->next = NULL;
+            return;
+        }
+        prev = *tpp;
+    }
+}
+
+// メッセージボックスの先頭のメッセージを取り出して msgp にコピーする
+// メッセージボックスが空の場合は呼ばれないことを呼び出し側が保証している
+// 戻り値は送信元の優先度
+static int msgget(kz_msgbox *mboxp, kz_msg_t *msgp)
+{
+    kz_msgbuf *mp = &mboxp->msgs[mboxp->head];
+
+    msgp->sender = mp->sender;
+    msgp->size   = mp->param.size;
+    msgp->p      = mp->param.p;
+
+    mboxp->head = (mboxp->head + 1) & (MSGBOX_MSG_NUM - 1);
+    mboxp->num--;
+
+    return mp->priority;
+}
+
+// メッセージボックスの先頭のメッセージを thp に受信させる
+static void recvmsg(kz_msgbox *mboxp, kz_thread *thp)
+{
+    kz_syscall_param_t *p = thp->syscall.param;
+    kz_msg_t msg;
+    int priority;
+
+    // kz_recv_many で待っていた場合は、配列の先頭に1つだけ受信させる
+    if (thp->syscall.type == KZ_SYSCALL_TYPE_RECV_MANY) {
+        priority = msgget(mboxp, &p->un.recv_many.msgs[0]);
+        p->un.recv_many.ret = 1;
+        server_update(mboxp, thp, priority);
+        return;
+    }
+
+    // メッセージボックスの先頭のメッセージを取り出す
+    // メッセージボックスが空の場合は呼ばれないことを
+    // recvmsg を呼び出す thread_send, thread_recv が保証している
+    priority = msgget(mboxp, &msg);
+    // サーバモードなら、受信した要求を処理する間は送信元の優先度で動作する
+    server_update(mboxp, thp, priority);
+
+    // 受信するスレッドに値をコピーする
+    p->un.recv.ret = msg.sender;
     // 出力引数にポインタが設定されていれば、コピー
     if (p->un.recv.sizep)
-        *(p->un.recv.sizep) = mp->param.size;
+        *(p->un.recv.sizep) = msg.size;
     if (p->un.recv.pp)
-        *(p->un.recv.pp) = mp->param.p;
-    
-    // 1回受信したら外す
-    mboxp->receiver = NULL;
-
-    // 値をコピーしたらメッセージバッファは削除
-    kzmem_free(mp);
+        *(p->un.recv.pp) = msg.p;
 }
 
 static int thread_send(kz_msgbox_id_t id, int size, char *p)
@@ -377,13 +1054,18 @@ static int thread_send(kz_msgbox_id_t id, int size, char *p)
 
     // システムコールを呼んだスレッドをレディーキューに戻す(送信処理はブロックされない)
     putcurrent();
-    sendmsg(mboxp, current, size, p);
+    // サービスコールの場合は current が NULL なので、送信元の ID は KZ_THREAD_ID_INTR になる
+    // メッセージボックスが一杯の場合は送信せずにエラーを返す
+    if (sendmsg(mboxp, current, size, p) < 0)
+        return -1;
 
-    // もし受信を待っているスレッドがあったら
+    // もし受信を待っているスレッドがあったら、先に待っていたスレッドに渡す
     if (mboxp->receiver) {
-        current = mboxp->receiver;
+        current = recvque_get(mboxp);
         // 受信処理をしたあと、受信待ちをしていたスレッドをレディーキューに戻す
-        recvmsg(mboxp);
+        // タイムアウト付きで待っていた場合はタイマキューからも外す
+        recvmsg(mboxp, current);
+        timeque_remove(current);
         putcurrent();
     }
 
@@ -394,27 +1076,155 @@ static kz_thread_id_t thread_recv(kz_msgbox_id_t id, int *sizep, char **pp)
 {
     kz_msgbox *mboxp = &msgboxes[id];
 
-    // 他のスレッドが受信待ちをしていたら OS が異常終了
-    if (mboxp->receiver)
-        kz_sysdown();
-    
-    // 今のスレッドを受信待ちとして設定
-    mboxp->receiver = current;
-
     // メッセージボックスにメッセージがないときに受信しようとしたら
-    if (mboxp->head == NULL) {
+    if (mboxp->num == 0) {
+        // 受信待ちキューの末尾につなぐ
+        // 複数のスレッドが受信待ちをしている場合は、待ち始めた順にメッセージを受け取る
         // putcurrent せずに戻るので、レディーキューから外れたままになる(ブロックされる)
+        recvque_put(mboxp, current);
+        // サーバモードなら処理中の要求はなくなったので、引き継いだ優先度を戻す
+        server_update(mboxp, current, PRIORITY_NUM);
         return -1;
     }
 
     // ここにくるということは、メッセージボックスに1つ以上のメッセージがある
-    recvmsg(mboxp);
+    // メッセージがあるときは受信待ちのスレッドはいないので、追い越しにはならない
+    recvmsg(mboxp, current);
     // メッセージ受信を完了したのでレディーキューに戻す
     putcurrent();
 
     return current->syscall.param->un.recv.ret;
 }
 
+// タイムアウト付きのメッセージ受信
+static kz_thread_id_t thread_recv_timeout(kz_msgbox_id_t id, int *sizep,
+                                          char **pp, long msec)
+{
+    kz_msgbox *mboxp = &msgboxes[id];
+    kz_thread_id_t ret;
+
+    ret = thread_recv(id, sizep, pp);
+    // メッセージがあってすぐに受信できた場合は、レディーキューに戻っている
+    if (current->flags & KZ_THREAD_FLAG_READY)
+        return ret;
+
+    if (msec <= 0) {
+        // 待ち時間が 0 以下なら待たずにタイムアウトとする
+        recvque_remove(mboxp, current);
+        putcurrent();
+        return 0;
+    }
+
+    // 受信待ちのままタイマキューにつなぐ
+    // 期限までにメッセージが来なければ timeout_expire で待ちが解除される
+    timeque_add(current, msec * 1000);
+    return -1;
+}
+
+// 待たずにメッセージを受信する
+// メッセージがなければ受信待ちにはならず、すぐに 0 を返す
+// (割込みハンドラからのメッセージの送信元は KZ_THREAD_ID_INTR なので、0 とは区別できる)
+static kz_thread_id_t thread_tryrecv(kz_msgbox_id_t id, int *sizep, char **pp)
+{
+    kz_msgbox *mboxp = &msgboxes[id];
+
+    // 受信できてもできなくても、呼び出したスレッドはブロックされない
+    if (mboxp->num == 0) {
+        putcurrent();
+        return 0;
+    }
+
+    recvmsg(mboxp, current);
+    putcurrent();
+    return current->syscall.param->un.recv.ret;
+}
+
+// たまっているメッセージをまとめて受信する
+// メッセージが1つもなければ kz_recv と同様に受信待ちになり、1つ届いたところで戻る
+// 1回のシステムコールで複数のメッセージを受け取れるので、負荷が高いときにトラップの回数を減らせる
+static int thread_recv_many(kz_msgbox_id_t id, kz_msg_t *msgs, int num)
+{
+    kz_msgbox *mboxp = &msgboxes[id];
+    int i, priority, held = PRIORITY_NUM;
+
+    if (num <= 0) {
+        putcurrent();
+        return 0;
+    }
+
+    if (mboxp->num == 0) {
+        // 受信待ちキューにつないでブロックする
+        // メッセージが届くと recvmsg で msgs[0] に受信させてから起こされる
+        recvque_put(mboxp, current);
+        server_update(mboxp, current, PRIORITY_NUM);
+        return -1;
+    }
+
+    for (i = 0; (i < num) && mboxp->num; i++) {
+        priority = msgget(mboxp, &msgs[i]);
+        if (priority < held)
+            held = priority;
+    }
+    // サーバモードなら、受信した要求の送信元のうち最も高い優先度を引き継ぐ
+    server_update(mboxp, current, held);
+    putcurrent();
+
+    return i;
+}
+
+// 同期型のメッセージ送信(ランデブー)
+// メッセージを送ったあと、受信したスレッドが kz_reply するまでブロックする
+// 受信待ちのスレッドがいれば、そのスレッドをキューの先頭につないで直接処理を渡す
+static int thread_call(kz_msgbox_id_t id, int size, char *p)
+{
+    kz_msgbox *mboxp = &msgboxes[id];
+    kz_thread *thp;
+
+    // メッセージボックスが一杯なら送信せず、待たずにエラーを返す
+    if (sendmsg(mboxp, current, size, p) < 0) {
+        putcurrent();
+        return -1;
+    }
+
+    if (mboxp->receiver) {
+        thp = recvque_get(mboxp);
+        recvmsg(mboxp, thp);
+        timeque_remove(thp);
+        puthead(thp);
+    }
+
+    // putcurrent せずに戻り、返信が来るまでレディーキューから外れたままになる
+    // 戻り値は kz_reply で返信のサイズに書き換えられる
+    return -1;
+}
+
+// kz_call で待っているスレッドに返信する
+// 返信先のスレッドをキューの先頭につなぎ、優先度が高ければそのまま処理を渡す
+static int thread_reply(kz_thread_id_t id, int size, char *p)
+{
+    kz_thread *thp = thread_lookup(id);
+    kz_syscall_param_t *param;
+
+    // サーバが返信したら要求の処理は終わりなので、引き継いだ優先度を戻す
+    server_update(current->served, current, PRIORITY_NUM);
+    // 返信したスレッドはブロックされない
+    putcurrent();
+
+    // kz_call でブロックしているスレッド以外には返信できない
+    // kz_call を呼んでいても、送信に失敗して戻っていれば READY になっている
+    if ((thp == NULL) || (thp->syscall.type != KZ_SYSCALL_TYPE_CALL) ||
+        (thp->flags & KZ_THREAD_FLAG_READY))
+        return -1;
+
+    param = thp->syscall.param;
+    param->un.call.ret = size;
+    if (param->un.call.rpp)
+        *(param->un.call.rpp) = p;
+    puthead(thp);
+
+    return 0;
+}
+
 // 割込みハンドラの登録(kz_setintr の処理)
 static void thread_intr(softvec_type_t type, unsigned long sp);
 static int thread_setintr(softvec_type_t type, kz_handler_t handler)
@@ -491,6 +1301,39 @@ static void call_functions(kz_syscall_type_t type, kz_syscall_param_t *p)
         p->un.setintr.ret = thread_setintr(p->un.setintr.type,
                                            p->un.setintr.handler);
         break;
+    case KZ_SYSCALL_TYPE_SLEEP_MS:
+        p->un.sleep_ms.ret = thread_sleep_ms(p->un.sleep_ms.msec);
+        break;
+    case KZ_SYSCALL_TYPE_RECV_TIMEOUT:
+        p->un.recv.ret = thread_recv_timeout(p->un.recv.id, p->un.recv.sizep,
+                                             p->un.recv.pp, p->un.recv.msec);
+        break;
+    case KZ_SYSCALL_TYPE_TRYRECV:
+        p->un.recv.ret = thread_tryrecv(p->un.recv.id,
+                                        p->un.recv.sizep, p->un.recv.pp);
+        break;
+    case KZ_SYSCALL_TYPE_RECV_MANY:
+        p->un.recv_many.ret = thread_recv_many(p->un.recv_many.id,
+                                               p->un.recv_many.msgs,
+                                               p->un.recv_many.num);
+        break;
+    case KZ_SYSCALL_TYPE_CALL:
+        p->un.call.ret = thread_call(p->un.call.id,
+                                     p->un.call.size, p->un.call.p);
+        break;
+    case KZ_SYSCALL_TYPE_REPLY:
+        p->un.reply.ret = thread_reply(p->un.reply.id,
+                                       p->un.reply.size, p->un.reply.p);
+        break;
+    case KZ_SYSCALL_TYPE_KMREPORT:
+        p->un.kmreport.ret = thread_kmreport();
+        break;
+    case KZ_SYSCALL_TYPE_STKREPORT:
+        p->un.stkreport.ret = thread_stkreport();
+        break;
+    case KZ_SYSCALL_TYPE_SETSERVER:
+        p->un.setserver.ret = thread_setserver(p->un.setserver.id);
+        break;
     default:
         break;
     }
@@ -519,26 +1362,37 @@ static void srvcall_proc(kz_syscall_type_t type, kz_syscall_param_t *p)
 }
 
 // ---------------------- 割込み処理 ----------------------
-// kozos は組み込み OS であり、一定時間ごとのスレッド切り替えは行わない
+// kozos は組み込み OS であり、基本的には優先度に従ってスレッドを切り替える
+// ただし同じ優先度のスレッド同士は、タイムスライスを使い切ると順番に切り替える
 
 // スレッドのスケジューリング(キューごとの優先度を考慮する)
 static void schedule(void)
 {
     int i;
 
-    // 優先度の高いレディーキューから順番に見て、動作可能なスレッドを探す
-    for (i = 0; i < PRIORITY_NUM; i++) {
-        // キューにタスクがつながっていれば探索終了
-        if (readyque[i].head)
-            break;
-    }
     // すべてのレディーキューが空の場合(全スレッドが終了)は異常終了
-    if (i == PRIORITY_NUM)
+    if (!readyque_bitmap)
         kz_sysdown();
 
+    // 動作可能なスレッドがいる最も優先度の高いキューをビットマップから求め、
     // キューの先頭のスレッドをスケジューリングする
+    i = readyque_first();
     current = readyque[i].head;
 
+    // タイムスライス用のタイマは、同じ優先度に動作可能なスレッドが複数あるときだけ動かす
+    // それ以外のときはタイマ割込みを止めて、アイドル時に無駄に起きないようにする
+    if (timeslice[i] && (current != readyque[i].tail)) {
+        if (!slice_timer) {
+            timer_start(TIMESLICE_TIMER_INDEX, TIMESLICE_TICK_USEC);
+            slice_timer = 1;
+            slice_thread = current;
+            slice_count = 0;
+        }
+    } else if (slice_timer) {
+        timer_cancel(TIMESLICE_TIMER_INDEX);
+        slice_timer = 0;
+    }
+
     // カレントタスクを切り替えているだけでまだ処理自体は移っていない
     // このあと dispatch するとカレントタスクが動き出す
 }
@@ -549,6 +1403,86 @@ static void syscall_intr(void)
     syscall_proc(current->syscall.type, current->syscall.param);
 }
 
+// タイムスライスの処理
+// 割込まれたスレッド(current)のタイムスライスを消費し、使い切ったら
+// 同じ優先度のキューの末尾に回す(ラウンドロビン)
+static void timeslice_proc(void)
+{
+    int quantum;
+
+    // 別のスレッドに切り替わっていたら、タイムスライスを数え直す
+    if (current != slice_thread) {
+        slice_thread = current;
+        slice_count = 0;
+    }
+
+    quantum = timeslice[current->priority];
+    if (!quantum || (++slice_count < quantum))
+        return;
+    slice_count = 0;
+
+    // 同じ優先度に他の動作可能なスレッドがなければ、切り替える必要はない
+    if (!(current->flags & KZ_THREAD_FLAG_READY) ||
+        (readyque[current->priority].head == readyque[current->priority].tail))
+        return;
+
+    // 実行中のスレッドはキューの先頭にいるので、外して末尾につなぎ直す
+    // このあとの schedule で、キューの次のスレッドが選ばれる
+    getcurrent();
+    putcurrent();
+}
+
+// 期限を迎えたスレッドの待ちを解除する
+static void timeout_expire(kz_thread *thp)
+{
+    kz_syscall_param_t *p = thp->syscall.param;
+
+    if (thp->syscall.type == KZ_SYSCALL_TYPE_RECV_TIMEOUT) {
+        // メッセージを受信できなかったので、受信待ちを取り消して 0 を返す
+        recvque_remove(&msgboxes[p->un.recv.id], thp);
+        p->un.recv.ret = 0;
+    }
+
+    current = thp;
+    putcurrent();
+}
+
+// 時間待ちの処理
+// 期限を迎えたスレッドをすべてレディーキューに戻し、次の期限でタイマをセットし直す
+static void timeout_proc(void)
+{
+    kz_thread *thp;
+
+    timeque_update();
+
+    while (timeque && (timeque->timeout.delta <= 0)) {
+        thp = timeque;
+        timeque = thp->timeout.next;
+        // 期限を過ぎてしまった分は、後ろのスレッドの待ち時間から差し引く
+        if (timeque)
+            timeque->timeout.delta += thp->timeout.delta;
+        thp->timeout.next = NULL;
+        thp->flags &= ~KZ_THREAD_FLAG_TIMEOUT;
+        timeout_expire(thp);
+    }
+
+    timeque_program();
+}
+
+// タイマ割込み
+static void timer_intr(void)
+{
+    // タイムスライスの処理は割込まれたスレッド(current)を使うので先に行う
+    if (timer_is_expired(TIMESLICE_TIMER_INDEX)) {
+        timer_expire(TIMESLICE_TIMER_INDEX);
+        timeslice_proc();
+    }
+
+    // 時間待ちの処理では current が書き換わる
+    if (timer_is_expired(TIMEOUT_TIMER_INDEX))
+        timeout_proc();
+}
+
 // ソフトウェアエラーの発生
 static void softerr_intr(void)
 {
@@ -569,18 +1503,35 @@ static void softerr_intr(void)
 // よって dispatch で処理が飛んでいってもスタックがリークすることはない
 static void thread_intr(softvec_type_t type, unsigned long sp)
 {
+    // 割込まれたスレッド
+    kz_thread *thp = current;
+
     // まず、カレントスレッドのコンテキストを保存する
     // 今のスタックポインタの位置を退避
     current->context.sp = sp;
 
+#ifdef KZ_STACK_CHECK
+    // 割込まれたスレッドのスタックがあふれていないかを検査する
+    stack_check(current, sp);
+#endif
+
     // type ごとにハンドラを呼び出し
     // SOFTVEC_TYPE_SYSCALL なら syscall_intr
     // SOFTVEC_TYPE_SOFTERR なら softerr_intr
     // が登録されている
     // それ以外の場合は kz_setintr によって登録されたハンドラが実行される
+    readyque_changed = 0;
     if (handlers[type])
         handlers[type]();
 
+    // スレッドの状態が変化しなかった割込み(送信割込みで文字を送っただけなど)では、
+    // 割込まれたスレッドがそのまま動き続けるので、スケジューリングせずにすぐ戻る
+    // (サービスコールを呼ぶと current は NULL になるので、割込まれたスレッドに戻す)
+    if (!readyque_changed) {
+        current = thp;
+        dispatch(&current->context);
+    }
+
     // 割り込み処理を終えたら、次に動作するスレッドをスケジューリングする
     schedule();
 
@@ -601,23 +1552,42 @@ static void thread_intr(softvec_type_t type, unsigned long sp)
 void kz_start(kz_func_t func, char *name, int priority, int stacksize,
               int argc, char *argv[])
 {
+    int i;
+
     kzmem_init();
-    
+    kzstack_init();
+
     // 初期化
     current = NULL;
     memset(readyque, 0, sizeof(readyque));
+    readyque_bitmap = 0;
     memset(threads, 0, sizeof(threads));
+    // すべての TCB を空き TCB リストにつなぐ
+    freethreads = NULL;
+    for (i = THREAD_NUM - 1; i >= 0; i--) {
+        threads[i].next = freethreads;
+        freethreads = &threads[i];
+    }
     memset(handlers, 0, sizeof(handlers));
     memset(msgboxes, 0, sizeof(msgboxes));
+    memset(&kmem_exited, 0, sizeof(kmem_exited));
+    memset(&kmem_intr, 0, sizeof(kmem_intr));
+    slice_thread = NULL;
+    slice_count = 0;
+    slice_timer = 0;
+    timeque = NULL;
+    timeque_programmed = 0;
 
     // 割込みハンドラの登録
     thread_setintr(SOFTVEC_TYPE_SYSCALL, syscall_intr);
     thread_setintr(SOFTVEC_TYPE_SOFTERR, softerr_intr);
+    // タイマは必要になったときに動かす
+    thread_setintr(SOFTVEC_TYPE_TIMINTR, timer_intr);
 
     // システムコールは呼び出せないので、直接関数を呼び出して最初のスレッド作成
     // 戻ってくるとレディーキューに最初のスレッドが追加されている
-    current = (kz_thread *)thread_run(func, name, priority, stacksize,
-                                      argc, argv);
+    current = thread_lookup(thread_run(func, name, priority, stacksize,
+                                       argc, argv));
 
     // 最初のスレッドを起動
     dispatch(&current->context);
@@ -16,20 +16,41 @@ void kz_exit(void);
 int kz_wait(void);
 // カレントスレッドをレディーキューから外す
 int kz_sleep(void);
-// スリープ状態のスレッドをレディーキューにつなぎ直す
+// カレントスレッドを指定した時間(ミリ秒)だけレディーキューから外す
+int kz_sleep_ms(long msec);
+// スリープ状態のスレッドをレディーキューにつなぎ直す(スリープしていなければ -1 を返す)
 int kz_wakeup(kz_thread_id_t id);
 // スレッドIDを取得
 kz_thread_id_t kz_getid(void);
 // スレッドの優先度を変更
 int kz_chpri(int priority);
-// メモリを確保
+// メモリを確保(確保できなければ NULL を返す)
 void *kz_kmalloc(int size);
 // メモリを解放
 int kz_kmfree(void *p);
-// メッセージ送信
+// 解放されていないメモリをスレッドごとに表示(解放されていないブロックの数を返す)
+int kz_kmreport(void);
+// スレッドごとのスタックの使用量の最大値を表示
+int kz_stkreport(void);
+// メッセージ送信(メッセージボックスが一杯なら -1 を返す)
 int kz_send(kz_msgbox_id_t id, int size, char *p);
 // メッセージ受信
 kz_thread_id_t kz_recv(kz_msgbox_id_t id, int *sizep, char **pp);
+// タイムアウト付きのメッセージ受信(タイムアウトしたら 0 を返す)
+// 割込みハンドラから送られたメッセージの送信元は KZ_THREAD_ID_INTR になる
+kz_thread_id_t kz_recv_timeout(kz_msgbox_id_t id, int *sizep, char **pp,
+                               long msec);
+// メッセージがあれば受信する(なければ待たずに 0 を返す)
+// 割込みハンドラから送られたメッセージの送信元は KZ_THREAD_ID_INTR になる
+kz_thread_id_t kz_tryrecv(kz_msgbox_id_t id, int *sizep, char **pp);
+// たまっているメッセージを最大 num 個まとめて受信(受信した数を返す)
+int kz_recv_many(kz_msgbox_id_t id, kz_msg_t *msgs, int num);
+// メッセージを送信し、相手が kz_reply するまで待つ(返信のサイズを返す)
+int kz_call(kz_msgbox_id_t id, int size, char *p, char **rpp);
+// kz_call で待っているスレッドに返信する
+int kz_reply(kz_thread_id_t id, int size, char *p);
+// 呼び出したスレッドをメッセージボックスのサーバにする(送信元の優先度を引き継ぐ)
+int kz_setserver(kz_msgbox_id_t id);
 // 割込みハンドラを設定する
 int kz_setintr(softvec_type_t type, kz_handler_t handler);
 
@@ -0,0 +1,214 @@
+// OS のイメージに、ブートローダが検査するための情報を書き込むホスト側のツール
+// (ターゲット用ではないので OBJS には含めない、Makefile でリンク後に実行する)
+//
+//   kzcrc <ELF ファイル>
+//
+// ELF ファイルの .kzimage セクション(ld.scr で RAM の先頭に確保している)に、
+// エントリポイントと、検査する各範囲のアドレス・サイズ・CRC32 を書き込む
+// 形式はブートローダの elf.c の struct elf_image に合わせる(ビッグエンディアン)
+// 範囲は次の2種類で、前者を先に並べる
+// - ロード可能な各セグメント(.data も含む): ロードした直後に検査する
+// - 実行中に書き換えられない .text と .rodata のセクション: verify コマンドで検査する
+//   (.data や .bss は OS が動くと書き換わるので、一度動かしたあとは検査できない)
+// - CRC32 は .kzimage 自体の範囲を 0 とみなして計算する
+// - .kzimage より前のアドレス(ELF ヘッダがロードされる、ソフトウェア割込みベクタと
+//   共用の領域)はブートローダが書き換えるので、検査の対象にしない
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_MAGIC 0x4b5a494d /* "KZIM" */
+#define IMAGE_SEGMENT_NUM 6
+#define IMAGE_SIZE (4 * 3 + 4 * 3 * IMAGE_SEGMENT_NUM)
+
+static unsigned char *elf;
+static long elf_size;
+
+static unsigned long get16(long offset)
+{
+    return ((unsigned long)elf[offset] << 8) | elf[offset + 1];
+}
+
+static unsigned long get32(long offset)
+{
+    return (get16(offset) << 16) | get16(offset + 2);
+}
+
+static void put16(unsigned char *p, unsigned long value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void put32(unsigned char *p, unsigned long value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// verify コマンドで検査する(実行中に書き換えられない)セクション
+static const char *check_sections[] = { ".text", ".rodata" };
+
+// 指定した名前のセクションを探し、ファイル中の位置とアドレスとサイズを返す
+static int find_section(const char *name, long *offset, unsigned long *addr,
+                        long *size)
+{
+    long shoff, shsize, shnum, strtab, sh;
+    int i;
+
+    shoff  = get32(0x20);
+    shsize = get16(0x2e);
+    shnum  = get16(0x30);
+    strtab = get32(shoff + shsize * get16(0x32) + 0x10);
+
+    for (i = 0; i < shnum; i++) {
+        sh = shoff + shsize * i;
+        if (!strcmp((char *)elf + strtab + get32(sh), name)) {
+            *addr   = get32(sh + 0x0c);
+            *offset = get32(sh + 0x10);
+            *size   = get32(sh + 0x14);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static unsigned long crc32(unsigned char *p, unsigned long addr, long size,
+                           unsigned long image_addr)
+{
+    unsigned long crc = 0xffffffff;
+    unsigned char c;
+    int i;
+
+    for (; size > 0; size--, p++, addr++) {
+        c = *p;
+        if ((addr >= image_addr) && (addr < image_addr + IMAGE_SIZE))
+            c = 0;
+        crc ^= c;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320 : 0);
+    }
+
+    return ~crc & 0xffffffff;
+}
+
+// 検査する範囲を1つ追加する
+static int add_range(unsigned char *image, int *num, const char *name,
+                     long offset, unsigned long addr, long size,
+                     unsigned long image_addr)
+{
+    unsigned long crc;
+
+    if (*num == IMAGE_SEGMENT_NUM) {
+        fprintf(stderr, "too many ranges to check\n");
+        return -1;
+    }
+
+    crc = crc32(elf + offset, addr, size, image_addr);
+    put32(image + 12 + *num * 12 + 0, addr);
+    put32(image + 12 + *num * 12 + 4, size);
+    put32(image + 12 + *num * 12 + 8, crc);
+    printf("%-8s %08lx %6ld bytes crc32 %08lx\n", name, addr, size, crc);
+    (*num)++;
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    unsigned char image[IMAGE_SIZE];
+    unsigned long image_addr, paddr;
+    long image_offset, image_size, ph, offset, size;
+    int i, num = 0, segment_num;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <elf>\n", argv[0]);
+        return 1;
+    }
+
+    if ((fp = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    elf_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    elf = malloc(elf_size);
+    if (!elf || (fread(elf, 1, elf_size, fp) != (size_t)elf_size)) {
+        fprintf(stderr, "%s: read error\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    // 32ビット、ビッグエンディアンの ELF であること
+    if (memcmp(elf, "\x7f" "ELF", 4) || (elf[4] != 1) || (elf[5] != 2)) {
+        fprintf(stderr, "%s: not a 32-bit big-endian ELF file\n", argv[1]);
+        return 1;
+    }
+    if ((find_section(".kzimage", &image_offset, &image_addr, &image_size) < 0) ||
+        (image_size < IMAGE_SIZE)) {
+        fprintf(stderr, "%s: no .kzimage section\n", argv[1]);
+        return 1;
+    }
+
+    memset(image, 0, sizeof(image));
+    put32(image + 0, IMAGE_MAGIC);
+    put32(image + 4, get32(0x18));
+
+    printf("%s:\n", argv[1]);
+
+    // ロード直後に検査する、ロード可能な各セグメント
+    for (i = 0; i < get16(0x2c); i++) {
+        ph = get32(0x1c) + get16(0x2a) * i;
+        // ロード可能で、ファイル中に実体があるセグメントだけを対象にする
+        if ((get32(ph) != 1) || !get32(ph + 0x10))
+            continue;
+        offset = get32(ph + 0x04);
+        paddr  = get32(ph + 0x0c);
+        size   = get32(ph + 0x10);
+        if (paddr + size <= image_addr)
+            continue;
+        if (paddr < image_addr) {
+            offset += image_addr - paddr;
+            size   -= image_addr - paddr;
+            paddr   = image_addr;
+        }
+        if (add_range(image, &num, "segment", offset, paddr, size,
+                      image_addr) < 0)
+            return 1;
+    }
+    segment_num = num;
+
+    // verify コマンドで検査する、書き換えられないセクション
+    for (i = 0; i < sizeof(check_sections) / sizeof(*check_sections); i++) {
+        // 空のセクションは対象にしない
+        if ((find_section(check_sections[i], &offset, &paddr, &size) < 0) ||
+            !size)
+            continue;
+        if (add_range(image, &num, check_sections[i], offset, paddr, size,
+                      image_addr) < 0)
+            return 1;
+    }
+
+    put16(image + 8, segment_num);
+    put16(image + 10, num - segment_num);
+
+    memcpy(elf + image_offset, image, sizeof(image));
+
+    if ((fp = fopen(argv[1], "wb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fwrite(elf, 1, elf_size, fp) != (size_t)elf_size) {
+        fprintf(stderr, "%s: write error\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    return 0;
+}
@@ -0,0 +1,112 @@
+// OS のイメージを LZSS で圧縮するホスト側のツール
+// (ターゲット用ではないので OBJS には含めない、Makefile の kzpack ターゲットで作る)
+//
+//   kzpack <入力ファイル> <出力ファイル>
+//
+// 出力の形式はブートローダの elf.c の展開処理に合わせる
+// - 先頭に "KZLZ" と展開後のサイズ(4バイト、ビッグエンディアン)
+// - フラグ1バイト(下位ビットから順に、1 ならそのままの1バイト、0 なら一致情報)と
+//   それに続く8個のデータの繰り返し
+// - 一致情報は2バイトで、上位9ビットが何バイト前か(1〜512)、下位7ビットが長さ(3〜130)
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WINDOW_SIZE 512
+#define LEN_BITS 7
+#define LEN_MIN 3
+#define LEN_MAX (LEN_MIN + (1 << LEN_BITS) - 1)
+
+static unsigned char *out;
+static long outlen;
+
+static void put(unsigned char c)
+{
+    out[outlen++] = c;
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp;
+    unsigned char *in;
+    long size, pos, i, len, best_len, best_offset, flag_pos;
+    int nflags;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+        return 1;
+    }
+
+    if ((fp = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    in = malloc(size + 1);
+    // 最悪の場合でも、8バイトごとにフラグ1バイトが増えるだけ
+    out = malloc(8 + size + size / 8 + 1);
+    if (!in || !out || (fread(in, 1, size, fp) != (size_t)size)) {
+        fprintf(stderr, "%s: read error\n", argv[1]);
+        return 1;
+    }
+    fclose(fp);
+
+    put('K'); put('Z'); put('L'); put('Z');
+    put(size >> 24); put(size >> 16); put(size >> 8); put(size);
+
+    flag_pos = 0;
+    nflags = 8;
+    for (pos = 0; pos < size; pos += best_len) {
+        if (nflags == 8) {
+            flag_pos = outlen;
+            put(0);
+            nflags = 0;
+        }
+
+        // 履歴の中で最も長く一致する位置を探す(重なっていてもよい)
+        best_len = 0;
+        best_offset = 0;
+        for (i = (pos > WINDOW_SIZE) ? pos - WINDOW_SIZE : 0; i < pos; i++) {
+            for (len = 0; (len < LEN_MAX) && (pos + len < size); len++) {
+                if (in[i + len] != in[pos + len])
+                    break;
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_offset = pos - i;
+            }
+        }
+
+        if (best_len >= LEN_MIN) {
+            unsigned int code = ((best_offset - 1) << LEN_BITS) |
+                                (best_len - LEN_MIN);
+            put(code >> 8);
+            put(code);
+        } else {
+            out[flag_pos] |= 1 << nflags;
+            put(in[pos]);
+            best_len = 1;
+        }
+        nflags++;
+    }
+
+    if ((fp = fopen(argv[2], "wb")) == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (fwrite(out, 1, outlen, fp) != (size_t)outlen) {
+        fprintf(stderr, "%s: write error\n", argv[2]);
+        return 1;
+    }
+    fclose(fp);
+
+    // 転送時間の目安は 9600bps(1バイトあたり10ビット)で計算する
+    printf("%s: %ld -> %ld bytes (%ld%%), %ld.%ld -> %ld.%ld sec at 9600bps\n",
+           argv[2], size, outlen, outlen * 100 / size,
+           size / 960, size % 960 * 10 / 960,
+           outlen / 960, outlen % 960 * 10 / 960);
+
+    return 0;
+}
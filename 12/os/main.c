@@ -19,7 +19,9 @@ static int start_threads(int argc, char *argv[])
 
     while (1) {
         // このスレッドに実行が戻ってきたらスリープする
-        // 今の段階だとスリープすると戻ってこない
+        // 割込みが入るまで戻ってこない
+        // タイマは時間待ちやタイムスライスが必要なときしか動かないので、
+        // 何もすることがなければ次の割込みまでずっとスリープしていられる
         asm volatile ("sleep");
     }
 
@@ -28,9 +30,15 @@ static int start_threads(int argc, char *argv[])
 
 int main(void)
 {
+    extern char bss_start, ebss; // リンカスクリプトで定義される
+
     // ブートローダでも割込みを無効にしているが、念のため OS 側でも無効化
     INTR_DISABLE;
 
+    // ブートローダはロード時に bss を 0 クリアするが、verify のあと run で
+    // もう一度起動したときは前回の値が残っているので、OS 側でもクリアする
+    memset(&bss_start, 0, &ebss - &bss_start);
+
     // 割込みを有効にしていない
     // システムコールに使うトラップ命令は割込み禁止でも実行される
     // 割込み禁止で止まるのはデバイス割込み(シリアルとか)のみ
@@ -3,27 +3,236 @@
 #include "lib.h"
 #include "memory.h"
 
+// メモリプールの構成表
+// コンパイル時に -DKZMEM_POOL_CONFIG=... で別のファイルを指定できる
+#ifndef KZMEM_POOL_CONFIG
+#define KZMEM_POOL_CONFIG "mempool.h"
+#endif
+#include KZMEM_POOL_CONFIG
+
+// デバッグモード(コンパイル時に -DKZMEM_DEBUG を指定する)
+// - 各ブロックの前後にガードワードを置き、バッファの書き込みすぎを検出する
+// - 解放したブロックをポイズン値で埋め、解放後の書き込みを検出する
+// - 二重解放や、確保していないアドレスの解放を検出する
+// - 確保・解放のたびに空きブロックのリストを検査する
+// 不正を検出すると kzmem_error で呼び出したスレッドの名前を表示して停止する
+// 指定しなければ検査のコードはすべてコンパイルされない
+#ifdef KZMEM_DEBUG
+#define KZMEM_GUARD  0xdeadbeefUL   // ガードワード
+#define KZMEM_POISON 0xdb           // 解放したブロックを埋める値
+// ブロックの末尾に置くガードワードの大きさ
+#define KZMEM_TAIL_SIZE ((int)sizeof(uint32))
+#else
+#define KZMEM_TAIL_SIZE 0
+#endif
+
 // メモリブロック構造体(獲得された各領域は、先頭に以下の構造体を持っている)
 typedef struct _kzmem_block {
     // メモリブロック同士はリンク構造で管理される
     struct _kzmem_block *next;
-    int size;
+    union {
+        int size;   // ヒープ領域のブロックのサイズ(ヘッダを含む)
+        int pool;   // プールのブロックが属しているプールの番号
+    } un;
+    // ブロックを確保したスレッドの ID(空きブロックは KZMEM_OWNER_NONE)
+    kz_thread_id_t owner;
+#ifdef KZMEM_DEBUG
+    // ヘッダの直後(確保した領域の直前)のガードワード
+    uint32 guard;
+#endif
 } kzmem_block;
 
+// メモリプールの構成
+// 構成表(KZMEM_POOL_CONFIG)から作り、実行中は書き換えない
+// (const にして rodata に置くので、ブートローダの verify で検査される範囲に入る)
+typedef struct _kzmem_pool_config {
+    int size;
+    int num;    // 最低限用意するブロック数
+    int share;  // 余った領域の配分
+} kzmem_pool_config;
+
+#define KZMEM_POOL_INIT(size, num, share) { size, num, share },
+static const kzmem_pool_config pool_config[] = {
+    KZMEM_POOL_TABLE(KZMEM_POOL_INIT)
+};
+
+#define MEMORY_AREA_NUM (sizeof(pool_config) / sizeof(*pool_config))
+
 // メモリプール
 // ブロックのサイズごとに用意する
+// 中身はすべて kzmem_init で構成から決めるので、bss に置く
+// (data に置いて書き換えると、OS をもう一度起動したときに前回の値が残ってしまう)
 typedef struct _kzmem_pool {
     int size;
-    int num;
+    int num;    // ブロック数(構成の数に余った領域の配分を足したもの)
+    char *start;    // プールの先頭のブロック
     kzmem_block *free;
 } kzmem_pool;
 
-static kzmem_pool pool[] = {
-    // 16バイト、32バイト、64バイトの3種類のメモリプールを定義する
-    { 16, 8, NULL }, { 32, 8, NULL }, { 64, 4, NULL }
-};
+static kzmem_pool pool[MEMORY_AREA_NUM];
 
-#define MEMORY_AREA_NUM (sizeof(pool) / sizeof(*pool))
+// 各プールのブロックが、ヘッダと末尾のガードワードより大きいことをコンパイル時に検査する
+// (デバッグモードではヘッダが大きくなるので、小さいブロックのプールは使えなくなる)
+// プリプロセッサでは sizeof が使えないので、条件が成り立たないと配列の大きさが負になり
+// コンパイルエラーになるようにする
+#define KZMEM_POOL_CHECK(size, num, share) \
+    typedef char kzmem_pool_too_small_##size \
+        [((size) > (int)sizeof(kzmem_block) + KZMEM_TAIL_SIZE) ? 1 : -1];
+KZMEM_POOL_TABLE(KZMEM_POOL_CHECK)
+
+// 確保するサイズ(ヘッダを含む)からプールの番号を引く表
+// サイズを 2^KZMEM_INDEX_SHIFT 単位に切り上げた値で引くので、プールのブロックのサイズは
+// 2^KZMEM_INDEX_SHIFT の倍数にしておく必要がある
+// 表の大きさはブロックのサイズの合計(最大のブロックのサイズ以上になる)から決める
+// プールに収まらないサイズには MEMORY_AREA_NUM (ヒープ領域)が入る
+#define KZMEM_INDEX_SHIFT 3
+#define KZMEM_POOL_SUM(size, num, share) + (size)
+#define KZMEM_INDEX_NUM (((0 KZMEM_POOL_TABLE(KZMEM_POOL_SUM)) >> KZMEM_INDEX_SHIFT) + 1)
+static uint8 pool_index[KZMEM_INDEX_NUM];
+
+// 最低限用意するブロックの合計サイズ
+#define KZMEM_POOL_SIZE(size, num, share) + (size) * (num)
+#define KZMEM_POOLS_SIZE (0 KZMEM_POOL_TABLE(KZMEM_POOL_SIZE))
+
+// プールの合計サイズをシンボルとしてリンカに渡す
+// リンカスクリプトで、freearea に収まっているかをリンク時に検査する
+#define KZMEM_STR(x)  KZMEM_STR_(x)
+#define KZMEM_STR_(x) #x
+asm(".global _kzmem_pools_size\n"
+    "\t.set _kzmem_pools_size, " KZMEM_STR(KZMEM_POOLS_SIZE));
+
+// ヒープ領域の確保サイズはヘッダの大きさの倍数に切り上げる
+// こうしておくと分割後の残りの領域には必ずヘッダが置ける
+// ヘッダの大きさは2のべき乗とは限らないので、ビットマスクではなく割り算で切り上げる
+#define KZMEM_HEAP_ALIGN ((int)sizeof(kzmem_block))
+#define KZMEM_HEAP_ROUND(size) \
+    ((((size) + KZMEM_HEAP_ALIGN - 1) / KZMEM_HEAP_ALIGN) * KZMEM_HEAP_ALIGN)
+
+// メモリプールに分けずに残った freearea の後ろ側はヒープ領域として使う
+// プールのブロックに収まらない大きさの要求や、プールが枯渇したときに使う
+// 空き領域はアドレス順のリンク構造で管理し、解放時に隣接する空き領域と結合する
+static char *heap_start;
+static char *heap_end;
+static kzmem_block *heap_free;
+
+// 使っていない領域の先頭(プールを初期化するたびに後ろにずれていく)
+static char *area;
+
+#ifdef KZMEM_DEBUG
+// ---------------------- デバッグモードの検査 ----------------------
+// ブロックの末尾のガードワードの位置
+static uint32 *kzmem_tail(kzmem_block *mp, int size)
+{
+    return (uint32 *)((char *)mp + size - KZMEM_TAIL_SIZE);
+}
+
+// ブロックの前後にガードワードを書き込む
+static void kzmem_set_guard(kzmem_block *mp, int size)
+{
+    mp->guard = KZMEM_GUARD;
+    *kzmem_tail(mp, size) = KZMEM_GUARD;
+}
+
+// 空きブロックの中身をポイズン値で埋める
+static void kzmem_poison(kzmem_block *mp, int size)
+{
+    memset(mp + 1, KZMEM_POISON, size - sizeof(*mp) - KZMEM_TAIL_SIZE);
+}
+
+// ブロックのガードワードが壊れていないかを検査する
+static void kzmem_check_guard(kzmem_block *mp, int size)
+{
+    if (mp->guard != KZMEM_GUARD)
+        kzmem_error("header overrun", mp + 1);
+    if (*kzmem_tail(mp, size) != KZMEM_GUARD)
+        kzmem_error("buffer overrun", mp + 1);
+}
+
+// 空きブロックのポイズン値が書き換えられていないかを検査する
+static void kzmem_check_poison(kzmem_block *mp, int size)
+{
+    unsigned char *p = (unsigned char *)(mp + 1);
+    int i;
+
+    for (i = 0; i < size - (int)sizeof(*mp) - KZMEM_TAIL_SIZE; i++) {
+        if (p[i] != KZMEM_POISON)
+            kzmem_error("write after free", mp + 1);
+    }
+}
+
+// プールの空きブロックのリストを検査する
+// リストの各ブロックがプールの範囲内のブロックの先頭を指し、空きのまま壊れていないこと
+static void kzmem_check_pool(kzmem_pool *p)
+{
+    kzmem_block *mp;
+    char *end = p->start + (long)p->size * p->num;
+
+    for (mp = p->free; mp; mp = mp->next) {
+        if (((char *)mp < p->start) || ((char *)mp >= end) ||
+            (((char *)mp - p->start) % p->size))
+            kzmem_error("free list broken", mp + 1);
+        if ((mp->un.pool != p - pool) || (mp->owner != KZMEM_OWNER_NONE))
+            kzmem_error("free block broken", mp + 1);
+        kzmem_check_guard(mp, p->size);
+        kzmem_check_poison(mp, p->size);
+    }
+}
+
+// ヒープ領域の空き領域のリストを検査する
+// アドレス順に並んでいて、重なっていないこと
+static void kzmem_check_heap(void)
+{
+    kzmem_block *mp;
+    char *prev_end = heap_start;
+
+    for (mp = heap_free; mp; mp = mp->next) {
+        if (((char *)mp < prev_end) || ((char *)mp + mp->un.size > heap_end) ||
+            (mp->un.size < KZMEM_HEAP_ALIGN))
+            kzmem_error("heap free list broken", mp + 1);
+        if ((mp->owner != KZMEM_OWNER_NONE) || (mp->guard != KZMEM_GUARD))
+            kzmem_error("heap free block broken", mp + 1);
+        prev_end = (char *)mp + mp->un.size;
+    }
+}
+
+// すべての空きブロックのリストを検査する
+static void kzmem_check(void)
+{
+    int i;
+
+    for (i = 0; i < MEMORY_AREA_NUM; i++)
+        kzmem_check_pool(&pool[i]);
+    kzmem_check_heap();
+}
+
+// 解放しようとしているブロックを検査する
+// 確保したブロックの先頭を指していて、まだ解放されておらず、ガードワードが壊れていないこと
+static void kzmem_check_free(kzmem_block *mp)
+{
+    kzmem_pool *p;
+    int size;
+
+    if (((char *)mp < pool[0].start) || ((char *)mp >= heap_end))
+        kzmem_error("free of unknown address", mp + 1);
+
+    if ((char *)mp >= heap_start) {
+        size = mp->un.size;
+        if ((size < KZMEM_HEAP_ALIGN) || ((char *)mp + size > heap_end))
+            kzmem_error("free of unknown address", mp + 1);
+    } else {
+        if ((mp->un.pool < 0) || (mp->un.pool >= MEMORY_AREA_NUM))
+            kzmem_error("free of unknown address", mp + 1);
+        p = &pool[mp->un.pool];
+        if (((char *)mp < p->start) || (((char *)mp - p->start) % p->size))
+            kzmem_error("free of unknown address", mp + 1);
+        size = p->size;
+    }
+
+    if (mp->owner == KZMEM_OWNER_NONE)
+        kzmem_error("double free", mp + 1);
+    kzmem_check_guard(mp, size);
+}
+#endif
 
 // メモリプールの初期化
 static int kzmem_init_pool(kzmem_pool *p)
@@ -31,21 +240,25 @@ static int kzmem_init_pool(kzmem_pool *p)
     int i;
     kzmem_block *mp;
     kzmem_block **mpp;
-    extern char freearea;           // freearea はリンカスクリプトで定義される
-    static char *area = &freearea;  // static なので徐々にずれていく
 
     // 使っていない領域の先頭を取得
     mp = (kzmem_block *)area;
+    p->start = area;
 
     mpp = &p->free;
-    // pool[] で定義した数だけループしてメモリブロックを確保する
+    // kzmem_split_pool で決めた数だけループしてメモリブロックを確保する
     for (i = 0; i < p->num; i++) {
         // 空き領域の先頭を指すようにポインタの値を更新し、リンク構造を作る
         *mpp = mp;
         // 確保した領域のヘッダ部分(kzmem_block)は 0 クリアする
         memset(mp, 0, sizeof(*mp));
-        // ヘッダにメモリブロックのサイズを記録
-        mp->size = p->size;
+        // ヘッダにプールの番号を記録
+        // 解放するときにプールを探さずに直接戻せる
+        mp->un.pool = p - pool;
+#ifdef KZMEM_DEBUG
+        kzmem_set_guard(mp, p->size);
+        kzmem_poison(mp, p->size);
+#endif
         // 次のループに備えて、今作ったヘッダの next が指す先を mpp に入れる
         mpp = &(mp->next);
         // メモリブロックの大きさ分、ポインタを先に進めることで、領域を確保する
@@ -57,75 +270,285 @@ static int kzmem_init_pool(kzmem_pool *p)
     return 0;
 }
 
+// ヒープ領域の初期化
+// プールに使った残りの freearea から efreearea までを1つの空き領域とする
+static int kzmem_init_heap(void)
+{
+    extern char efreearea;  // efreearea はリンカスクリプトで定義される
+
+    heap_start = area;
+    heap_free = (kzmem_block *)area;
+    heap_free->next = NULL;
+    heap_free->un.size = ((&efreearea - area) / KZMEM_HEAP_ALIGN) *
+        KZMEM_HEAP_ALIGN;
+    heap_free->owner = KZMEM_OWNER_NONE;
+#ifdef KZMEM_DEBUG
+    heap_free->guard = KZMEM_GUARD;
+#endif
+    heap_end = heap_start + heap_free->un.size;
+
+    return 0;
+}
+
+// ヒープ領域から確保する(first-fit)
+// ブロックのヘッダには、ヘッダを含めたブロックのサイズを記録する
+static kzmem_block *kzmem_alloc_heap(int size)
+{
+    kzmem_block **mpp, *mp;
+    int s;
+
+    // ヒープ全体より大きな要求は、ヘッダを足すと int があふれることもあるので
+    // サイズを計算する前に long で比べて断る
+    if ((long)size > (long)(heap_end - heap_start) -
+        (long)sizeof(kzmem_block) - KZMEM_TAIL_SIZE)
+        return NULL;
+
+    s = KZMEM_HEAP_ROUND(size + (int)sizeof(kzmem_block) + KZMEM_TAIL_SIZE);
+
+    // アドレスの低いほうから順に見て、最初に収まった空き領域から切り出す
+    for (mpp = &heap_free; (mp = *mpp) != NULL; mpp = &mp->next) {
+        if (mp->un.size < s)
+            continue;
+
+        if (mp->un.size == s) {
+            // ちょうどの大きさなら空き領域ごとリストから外す
+            *mpp = mp->next;
+        } else {
+            // 空き領域の後ろ側を切り出すと、ヘッダを移動させずに済む
+            mp->un.size -= s;
+            mp = (kzmem_block *)((char *)mp + mp->un.size);
+            mp->un.size = s;
+        }
+        mp->next = NULL;
+
+        return mp;
+    }
+
+    // 収まる空き領域がない
+    return NULL;
+}
+
+// ヒープ領域に返却する
+// 前後の空き領域と隣接していれば結合する
+static void kzmem_free_heap(kzmem_block *mp)
+{
+    kzmem_block **mpp, *bp, *prev = NULL;
+
+    // 解放する領域より後ろにある最初の空き領域を探す
+    for (mpp = &heap_free; (bp = *mpp) != NULL; mpp = &bp->next) {
+        if (bp > mp)
+            break;
+        prev = bp;
+    }
+
+    mp->next = bp;
+    mp->owner = KZMEM_OWNER_NONE;
+    // 後ろの空き領域と隣接していれば結合
+    if (bp && ((char *)mp + mp->un.size == (char *)bp)) {
+        mp->un.size += bp->un.size;
+        mp->next = bp->next;
+    }
+
+    // 前の空き領域と隣接していれば結合、そうでなければリストに挿入
+    if (prev && ((char *)prev + prev->un.size == (char *)mp)) {
+        prev->un.size += mp->un.size;
+        prev->next = mp->next;
+    } else {
+        *mpp = mp;
+    }
+}
+
+// サイズからプールの番号を引く表を作る
+static void kzmem_init_index(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < KZMEM_INDEX_NUM; i++) {
+        // 小さい順に並んでいるので、収まる最初のプールを探す
+        while ((n < MEMORY_AREA_NUM) &&
+               (pool[n].size < (i << KZMEM_INDEX_SHIFT)))
+            n++;
+        pool_index[i] = n;
+    }
+}
+
+// 最低限のブロックを確保した残りの領域を、構成表の配分に従って各プールに分ける
+// 残りの分はヒープ領域になる
+static void kzmem_split_pool(void)
+{
+    int i, shares = KZMEM_HEAP_SHARE;
+    long rest, unit;
+    extern char freearea, efreearea; // リンカスクリプトで定義される
+
+    for (i = 0; i < MEMORY_AREA_NUM; i++)
+        shares += pool_config[i].share;
+
+    rest = (&efreearea - &freearea) - KZMEM_POOLS_SIZE;
+    unit = rest / shares;
+
+    for (i = 0; i < MEMORY_AREA_NUM; i++) {
+        pool[i].size = pool_config[i].size;
+        pool[i].num  = pool_config[i].num +
+            (unit * pool_config[i].share) / pool_config[i].size;
+    }
+}
+
 int kzmem_init(void)
 {
     int i;
+    extern char freearea;   // freearea はリンカスクリプトで定義される
+
+    area = &freearea;
+
+    // freearea の大きさに合わせて各プールのブロック数を決める
+    kzmem_split_pool();
 
     // メモリブロックのサイズごとに初期化を実施
     for (i = 0; i < MEMORY_AREA_NUM; i++) {
         kzmem_init_pool(&pool[i]);
     }
 
+    // 残りはすべてヒープ領域にする
+    kzmem_init_heap();
+
+    kzmem_init_index();
+
     return 0;
 }
 
-void *kzmem_alloc(int size)
+// プールかヒープ領域からブロックを取り出す
+static kzmem_block *kzmem_get(int size)
 {
     int i;
     kzmem_block *mp;
     kzmem_pool *p;
 
-    for (i = 0; i < MEMORY_AREA_NUM; i++) {
-        p = &pool[i];
-
-        // 確保しようとしているサイズがブロックのサイズよりも小さいか(ヘッダ分は差し引く)
-        if (size <= p->size - sizeof(kzmem_block)) {
-            if (p->free == NULL) {
-                // メモリが枯渇している
-                kz_sysdown();
-                return NULL;
-            }
+    if (size < 0)
+        return NULL;
 
-            // 先頭のブロックをリストから外し、割り当て
-            mp = p->free;
-            p->free = p->free->next;
-            // 割り当てたメモリブロックの next ポインタはクリアしておく
-            mp->next = NULL;
+    // 確保するサイズ(ヘッダ分を足す)に合うプールを表引きで求める
+    i = (size + sizeof(kzmem_block) + KZMEM_TAIL_SIZE +
+         (1 << KZMEM_INDEX_SHIFT) - 1) >> KZMEM_INDEX_SHIFT;
+    // 最大のメモリブロックより大きな領域はヒープ領域から確保する
+    if ((i >= KZMEM_INDEX_NUM) || ((i = pool_index[i]) == MEMORY_AREA_NUM))
+        return kzmem_alloc_heap(size);
 
-            // mp の型は kzmem_block* なので、アドレスに 1 を足すと
-            // sizeof(kzmem_block) 分加算され、ヘッダ直後のアドレスが帰ってくる
-            return mp + 1;
-        }
+    p = &pool[i];
+    if (p->free == NULL) {
+        // プールが枯渇しているときはヒープ領域から確保する
+        return kzmem_alloc_heap(size);
     }
 
-    // 最大のメモリブロックより大きな領域を確保しようとしたらエラー
-    kz_sysdown();
-    return NULL;
+    // 先頭のブロックをリストから外し、割り当て
+    mp = p->free;
+    p->free = p->free->next;
+    // 割り当てたメモリブロックの next ポインタはクリアしておく
+    mp->next = NULL;
+
+    return mp;
+}
+
+// メモリを確保する
+// owner は確保したスレッドの ID で、ブロックのヘッダに記録しておく
+// 確保できなければ NULL を返す(呼び出し側で処理すること)
+void *kzmem_alloc(int size, kz_thread_id_t owner)
+{
+    kzmem_block *mp;
+
+#ifdef KZMEM_DEBUG
+    kzmem_check();
+#endif
+
+    mp = kzmem_get(size);
+    if (mp == NULL)
+        return NULL;
+    mp->owner = owner;
+
+#ifdef KZMEM_DEBUG
+    // ヒープ領域から切り出したブロックにはまだガードワードがないので、ここで書く
+    kzmem_set_guard(mp, kzmem_size(mp + 1));
+#endif
+
+    // mp の型は kzmem_block* なので、アドレスに 1 を足すと
+    // sizeof(kzmem_block) 分加算され、ヘッダ直後のアドレスが帰ってくる
+    return mp + 1;
 }
 
 void kzmem_free(void *mem)
 {
-    int i;
     kzmem_block *mp;
     kzmem_pool *p;
 
+    if (mem == NULL)
+        return;
+
     // 渡されたアドレスの直前にあるヘッダにアクセス
     mp = ((kzmem_block *)mem - 1);
 
-    for (i = 0; i < MEMORY_AREA_NUM; i++) {
-        p = &pool[i];
+#ifdef KZMEM_DEBUG
+    kzmem_check();
+    kzmem_check_free(mp);
+    kzmem_poison(mp, kzmem_size(mem));
+#endif
+
+    // ヒープ領域から確保したブロックはプールではなくヒープ領域に返す
+    if ((char *)mp >= heap_start) {
+        kzmem_free_heap(mp);
+        return;
+    }
+
+    // ヘッダに記録しておいたプールに戻す
+    // 解放するブロックはリストの先頭に入れる
+    p = &pool[mp->un.pool];
+    mp->owner = KZMEM_OWNER_NONE;
+    mp->next = p->free;
+    p->free = mp;
+}
+
+// 確保したブロックのサイズ(ヘッダを含む)を返す
+int kzmem_size(void *mem)
+{
+    kzmem_block *mp = ((kzmem_block *)mem - 1);
 
-        // 解放したいメモリブロックと同じサイズのプールを探す
-        if (mp->size == p->size) {
-            // 解放するブロックはリストの先頭に入れる
-            // 今 free が指しているところを解放するブロックにコピー
-            mp->next = p->free;
-            // free は新しく解放したブロックを指す
-            p->free = mp;
+    if ((char *)mp >= heap_start)
+        return mp->un.size;
+    return pool[mp->un.pool].size;
+}
+
+// 確保したブロックの持ち主(確保したスレッドの ID)を返す
+kz_thread_id_t kzmem_owner(void *mem)
+{
+    return ((kzmem_block *)mem - 1)->owner;
+}
+
+// 確保されているすべてのブロックについて func を呼び出す
+// 確保されているブロックの数を返す
+int kzmem_walk(kzmem_walk_func_t func)
+{
+    int i, j, n = 0;
+    kzmem_block *mp;
+    char *cp;
+
+    // プールのブロックは先頭から順に並んでいる
+    for (i = 0; i < MEMORY_AREA_NUM; i++) {
+        cp = pool[i].start;
+        for (j = 0; j < pool[i].num; j++, cp += pool[i].size) {
+            mp = (kzmem_block *)cp;
+            if (mp->owner != KZMEM_OWNER_NONE) {
+                func(mp + 1, pool[i].size, mp->owner);
+                n++;
+            }
+        }
+    }
 
-            return;
+    // ヒープ領域のブロックは、空きブロックも含めてヘッダのサイズでたどれる
+    for (cp = heap_start; cp < heap_end; cp += mp->un.size) {
+        mp = (kzmem_block *)cp;
+        if (mp->owner != KZMEM_OWNER_NONE) {
+            func(mp + 1, mp->un.size, mp->owner);
+            n++;
         }
     }
 
-    kz_sysdown();
+    return n;
 }
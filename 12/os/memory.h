@@ -1,8 +1,23 @@
 #ifndef _KOZOS_MEMORY_H_INCLUDED_
 #define _KOZOS_MEMORY_H_INCLUDED_
 
+// ブロックの持ち主を表す特別な ID
+// スレッドID は下位8ビットが 0 にならないので、スレッドの ID と重ならない
+#define KZMEM_OWNER_NONE 0                              // 空きブロック
+#define KZMEM_OWNER_INTR KZ_THREAD_ID_INTR  // 割込みハンドラで確保したブロック
+
+typedef void (*kzmem_walk_func_t)(void *mem, int size, kz_thread_id_t owner);
+
 int kzmem_init(void);
-void *kzmem_alloc(int size);
+void *kzmem_alloc(int size, kz_thread_id_t owner);
 void kzmem_free(void *mem);
+int kzmem_size(void *mem);
+kz_thread_id_t kzmem_owner(void *mem);
+int kzmem_walk(kzmem_walk_func_t func);
+
+#ifdef KZMEM_DEBUG
+// メモリの不正な操作を検出したときに呼ばれる(kozos.c で定義する)
+void kzmem_error(char *msg, void *mem);
+#endif
 
 #endif
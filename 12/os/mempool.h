@@ -0,0 +1,30 @@
+#ifndef _KOZOS_MEMPOOL_H_INCLUDED_
+#define _KOZOS_MEMPOOL_H_INCLUDED_
+
+// メモリプールの構成表
+// Makefile の MEMPOOL_CONFIG で別のファイルに差し替えられる(ファームウェアごとの調整用)
+//
+// POOL(ブロックのサイズ, 最低限用意するブロック数, 余った領域の配分)
+// - ブロックのサイズは小さい順に並べ、8 の倍数にすること
+// - 最低限用意するブロック数の合計が freearea に収まらなければリンクでエラーになる
+// - freearea の余りは、配分の比率に従って各プールとヒープ領域に分ける
+// - ブロックのサイズはヘッダ(デバッグモードではガードワードも)より大きくすること
+//   (小さすぎるとコンパイルでエラーになる)
+#ifdef KZMEM_DEBUG
+// デバッグモードではヘッダとガードワードだけで 16 バイトを超えるので、
+// 16 バイトのプールの分は 32 バイトのプールに回す
+#define KZMEM_POOL_TABLE(POOL) \
+    POOL(32, 12, 3) \
+    POOL(64, 4, 1)
+#else
+#define KZMEM_POOL_TABLE(POOL) \
+    POOL(16, 8, 1) \
+    POOL(32, 8, 2) \
+    POOL(64, 4, 1)
+#endif
+
+// 余った領域のうちヒープ領域に残す分の配分
+// ヒープ領域は、プールに収まらない大きさの要求やプールが枯渇したときに使う
+#define KZMEM_HEAP_SHARE 4
+
+#endif
@@ -0,0 +1,114 @@
+#include "defines.h"
+#include "kozos.h"
+#include "lib.h"
+#include "stack.h"
+
+// 空きスタック領域のヘッダ(空き領域の先頭に置かれる)
+// 空き領域同士はアドレス順のリンク構造で管理される
+typedef struct _kzstack_block {
+    struct _kzstack_block *next;
+    long size;
+} kzstack_block;
+
+// 確保するサイズはヘッダの大きさの倍数に切り上げる
+// こうしておくと分割後の残りの領域には必ずヘッダが置ける
+#define KZSTACK_ALIGN ((long)sizeof(kzstack_block))
+
+static kzstack_block *freelist;
+static long used;       // 現在使用中のサイズ
+static long maxused;    // 使用中のサイズの最大値(ハイウォーターマーク)
+
+// 確保するときと同じ大きさに切り上げたサイズを返す
+long kzstack_round(int size)
+{
+    return ((long)size + KZSTACK_ALIGN - 1) & ~(KZSTACK_ALIGN - 1);
+}
+
+// スタック領域の初期化
+// userstack から euserstack までを1つの空き領域とする
+int kzstack_init(void)
+{
+    extern char userstack, euserstack; // リンカスクリプトで定義されるアドレス
+
+    freelist = (kzstack_block *)&userstack;
+    freelist->next = NULL;
+    freelist->size = &euserstack - &userstack;
+    used = 0;
+    maxused = 0;
+
+    return 0;
+}
+
+// スタックを確保する(first-fit)
+// 戻り値はスタック領域の下端のアドレス(スタックは上端から下に伸びる)
+char *kzstack_alloc(int size)
+{
+    kzstack_block **bpp, *bp;
+    long s = kzstack_round(size);
+
+    // 大きさ 0 のスタックは確保できない
+    if (size <= 0)
+        return NULL;
+
+    // アドレスの低いほうから順に見て、最初に収まった空き領域から切り出す
+    for (bpp = &freelist; (bp = *bpp) != NULL; bpp = &bp->next) {
+        if (bp->size < s)
+            continue;
+
+        used += s;
+        if (used > maxused)
+            maxused = used;
+
+        if (bp->size == s) {
+            // ちょうどの大きさなら空き領域ごとリストから外す
+            *bpp = bp->next;
+            return (char *)bp;
+        }
+        // 空き領域の後ろ側を切り出すと、ヘッダを移動させずに済む
+        bp->size -= s;
+        return (char *)bp + bp->size;
+    }
+
+    // 収まる空き領域がない
+    return NULL;
+}
+
+// スタックを解放する
+// 前後の空き領域と隣接していれば結合する
+void kzstack_free(char *stack, int size)
+{
+    kzstack_block **bpp, *bp, *prev = NULL;
+    kzstack_block *mp = (kzstack_block *)stack;
+    long s = kzstack_round(size);
+
+    used -= s;
+
+    // 解放する領域より後ろにある最初の空き領域を探す
+    for (bpp = &freelist; (bp = *bpp) != NULL; bpp = &bp->next) {
+        if ((char *)bp > stack)
+            break;
+        prev = bp;
+    }
+
+    mp->size = s;
+    mp->next = bp;
+    // 後ろの空き領域と隣接していれば結合
+    if (bp && ((char *)mp + mp->size == (char *)bp)) {
+        mp->size += bp->size;
+        mp->next = bp->next;
+    }
+
+    // 前の空き領域と隣接していれば結合、そうでなければリストに挿入
+    if (prev && ((char *)prev + prev->size == (char *)mp)) {
+        prev->size += mp->size;
+        prev->next = mp->next;
+    } else {
+        *bpp = mp;
+    }
+}
+
+// スタック領域の使用量のハイウォーターマークを返す
+long kzstack_maxused(void)
+{
+    return maxused;
+}
@@ -0,0 +1,10 @@
+#ifndef _KOZOS_STACK_H_INCLUDED_
+#define _KOZOS_STACK_H_INCLUDED_
+
+int kzstack_init(void);
+long kzstack_round(int size);
+char *kzstack_alloc(int size);
+void kzstack_free(char *stack, int size);
+long kzstack_maxused(void);
+
+#endif
@@ -38,6 +38,14 @@ int kz_sleep(void)
     return param.un.sleep.ret;
 }
 
+int kz_sleep_ms(long msec)
+{
+    kz_syscall_param_t param;
+    param.un.sleep_ms.msec = msec;
+    kz_syscall(KZ_SYSCALL_TYPE_SLEEP_MS, &param);
+    return param.un.sleep_ms.ret;
+}
+
 int kz_wakeup(kz_thread_id_t id)
 {
     kz_syscall_param_t param;
@@ -77,6 +85,20 @@ int kz_kmfree(void *p)
     return param.un.kmfree.ret;
 }
 
+int kz_kmreport(void)
+{
+    kz_syscall_param_t param;
+    kz_syscall(KZ_SYSCALL_TYPE_KMREPORT, &param);
+    return param.un.kmreport.ret;
+}
+
+int kz_stkreport(void)
+{
+    kz_syscall_param_t param;
+    kz_syscall(KZ_SYSCALL_TYPE_STKREPORT, &param);
+    return param.un.stkreport.ret;
+}
+
 int kz_send(kz_msgbox_id_t id, int size, char *p)
 {
     kz_syscall_param_t param;
@@ -97,6 +119,67 @@ kz_thread_id_t kz_recv(kz_msgbox_id_t id, int *sizep, char **pp)
     return param.un.recv.ret;
 }
 
+kz_thread_id_t kz_recv_timeout(kz_msgbox_id_t id, int *sizep, char **pp,
+                               long msec)
+{
+    kz_syscall_param_t param;
+    param.un.recv.id = id;
+    param.un.recv.sizep = sizep;
+    param.un.recv.pp = pp;
+    param.un.recv.msec = msec;
+    kz_syscall(KZ_SYSCALL_TYPE_RECV_TIMEOUT, &param);
+    return param.un.recv.ret;
+}
+
+kz_thread_id_t kz_tryrecv(kz_msgbox_id_t id, int *sizep, char **pp)
+{
+    kz_syscall_param_t param;
+    param.un.recv.id = id;
+    param.un.recv.sizep = sizep;
+    param.un.recv.pp = pp;
+    kz_syscall(KZ_SYSCALL_TYPE_TRYRECV, &param);
+    return param.un.recv.ret;
+}
+
+int kz_recv_many(kz_msgbox_id_t id, kz_msg_t *msgs, int num)
+{
+    kz_syscall_param_t param;
+    param.un.recv_many.id = id;
+    param.un.recv_many.msgs = msgs;
+    param.un.recv_many.num = num;
+    kz_syscall(KZ_SYSCALL_TYPE_RECV_MANY, &param);
+    return param.un.recv_many.ret;
+}
+
+int kz_call(kz_msgbox_id_t id, int size, char *p, char **rpp)
+{
+    kz_syscall_param_t param;
+    param.un.call.id = id;
+    param.un.call.size = size;
+    param.un.call.p = p;
+    param.un.call.rpp = rpp;
+    kz_syscall(KZ_SYSCALL_TYPE_CALL, &param);
+    return param.un.call.ret;
+}
+
+int kz_reply(kz_thread_id_t id, int size, char *p)
+{
+    kz_syscall_param_t param;
+    param.un.reply.id = id;
+    param.un.reply.size = size;
+    param.un.reply.p = p;
+    kz_syscall(KZ_SYSCALL_TYPE_REPLY, &param);
+    return param.un.reply.ret;
+}
+
+int kz_setserver(kz_msgbox_id_t id)
+{
+    kz_syscall_param_t param;
+    param.un.setserver.id = id;
+    kz_syscall(KZ_SYSCALL_TYPE_SETSERVER, &param);
+    return param.un.setserver.ret;
+}
+
 int kz_setintr(softvec_type_t type, kz_handler_t handler)
 {
     kz_syscall_param_t param;
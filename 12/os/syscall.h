@@ -18,8 +18,24 @@ typedef enum {
     KZ_SYSCALL_TYPE_SEND,
     KZ_SYSCALL_TYPE_RECV,
     KZ_SYSCALL_TYPE_SETINTR,
+    KZ_SYSCALL_TYPE_SLEEP_MS,
+    KZ_SYSCALL_TYPE_RECV_TIMEOUT,
+    KZ_SYSCALL_TYPE_TRYRECV,
+    KZ_SYSCALL_TYPE_RECV_MANY,
+    KZ_SYSCALL_TYPE_CALL,
+    KZ_SYSCALL_TYPE_REPLY,
+    KZ_SYSCALL_TYPE_SETSERVER,
+    KZ_SYSCALL_TYPE_KMREPORT,
+    KZ_SYSCALL_TYPE_STKREPORT,
 } kz_syscall_type_t;
 
+// kz_recv_many で受け取るメッセージ1つ分
+typedef struct {
+    kz_thread_id_t sender;  // 送信元のスレッドID
+    int size;               // メッセージのサイズ
+    char *p;                // メッセージの中身
+} kz_msg_t;
+
 // システムコール呼び出し時のパラメータ格納域の定義
 // システムコールごとに専用の構造体を用意する
 typedef struct {
@@ -46,6 +62,11 @@ typedef struct {
             int ret;
         } sleep;
 
+        struct {
+            long msec;
+            int ret;
+        } sleep_ms;
+
         struct {
             kz_thread_id_t id;
             int ret;
@@ -70,6 +91,14 @@ typedef struct {
             int ret;
         } kmfree;
 
+        struct {
+            int ret;
+        } kmreport;
+
+        struct {
+            int ret;
+        } stkreport;
+
         struct {
             kz_msgbox_id_t id;
             int size;
@@ -81,9 +110,37 @@ typedef struct {
             kz_msgbox_id_t id;
             int *sizep;
             char **pp;
+            long msec;          // kz_recv_timeout の待ち時間
             kz_thread_id_t ret;
         } recv;
 
+        struct {
+            kz_msgbox_id_t id;
+            kz_msg_t *msgs;     // 受信したメッセージを格納する配列
+            int num;            // 配列の要素数(一度に受信する最大数)
+            int ret;
+        } recv_many;
+
+        struct {
+            kz_msgbox_id_t id;
+            int size;
+            char *p;
+            char **rpp;         // 返信の中身を受け取る領域
+            int ret;            // 返信のサイズ
+        } call;
+
+        struct {
+            kz_thread_id_t id;  // 返信先(kz_call を呼んだスレッド)
+            int size;
+            char *p;
+            int ret;
+        } reply;
+
+        struct {
+            kz_msgbox_id_t id;
+            int ret;
+        } setserver;
+
         struct {
             softvec_type_t type;
             kz_handler_t handler;
@@ -0,0 +1,99 @@
+#include "defines.h"
+#include "kozos.h"
+#include "lib.h"
+
+// 優先度継承のテスト
+// start_threads から consdrv_main, command_main の代わりに以下の2つを起動する
+//   kz_run(test12_1_server, "server", 12, 0x100, 0, NULL);
+//   kz_run(test12_1_client, "client",  2, 0x100, 0, NULL);
+// hog(優先度6)はクライアントが最初の要求の返信を受け取ってから起動する
+// (先に起動すると、サーバが kz_setserver と kz_recv にたどりつく前に hog が
+//  CPU を使い続けてしまい、最初の kz_call が返ってこない)
+// 低い優先度のサーバに高い優先度のクライアントが要求を出している間、
+// 中間の優先度のスレッド(hog)が動き続けていても、サーバはクライアントの優先度を
+// 引き継ぐので hog に割り込まれない
+// 優先度継承がなければ、hog が終わるまでクライアントへの返信は返ってこない
+
+#define TEST12_1_LOOP  10000
+#define TEST12_1_CALLS 4
+
+static volatile long hog_count;
+static volatile int hog_stop;
+
+int test12_1_server(int argc, char *argv[])
+{
+    volatile long i;
+    kz_thread_id_t id;
+    int size;
+    char *p;
+
+    puts("test12_1 server started.\n");
+
+    // 受信するメッセージボックスをサーバモードにする
+    kz_setserver(MSGBOX_ID_CONSOUTPUT);
+
+    while (1) {
+        id = kz_recv(MSGBOX_ID_CONSOUTPUT, &size, &p);
+        // 要求を処理しているつもりで時間をつぶす
+        for (i = 0; i < TEST12_1_LOOP; i++)
+            ;
+        kz_reply(id, size, p);
+    }
+
+    return 0;
+}
+
+int test12_1_hog(int argc, char *argv[])
+{
+    puts("test12_1 hog started.\n");
+
+    // 止められるまで CPU を使い続ける
+    while (!hog_stop)
+        hog_count++;
+
+    puts("test12_1 hog exit.\n");
+
+    return 0;
+}
+
+int test12_1_client(int argc, char *argv[])
+{
+    long before, count, worst = 0;
+    int i;
+
+    puts("test12_1 client started.\n");
+
+    // サーバがサーバモードにして受信待ちになるまで待ってから、hog なしで1回呼ぶ
+    // 返信が返ってくれば、サーバは kz_recv で待っている状態に戻っている
+    kz_sleep_ms(10);
+    kz_call(MSGBOX_ID_CONSOUTPUT, 1, "x", NULL);
+    puts("test12_1 server ready.\n");
+
+    // サーバの優先度(12)より高く、クライアント(2)より低い優先度で hog を起動する
+    kz_run(test12_1_hog, "hog", 6, 0x100, 0, NULL);
+
+    for (i = 0; i < TEST12_1_CALLS; i++) {
+        // hog が動き出すまで待つ(その間、サーバは受信待ちのまま)
+        kz_sleep_ms(10);
+
+        // 要求を出してから返信が返ってくるまでの間に hog が動いた量を計る
+        before = hog_count;
+        kz_call(MSGBOX_ID_CONSOUTPUT, 1, "x", NULL);
+        count = hog_count - before;
+        puts("test12_1 hog count: ");
+        putxval(count, 0);
+        puts("\n");
+        if (count > worst)
+            worst = count;
+    }
+
+    // 最悪の場合でも hog はまったく動かないはず
+    puts("test12_1 worst hog count: ");
+    putxval(worst, 0);
+    puts(worst ? " NG\n" : " OK\n");
+
+    hog_stop = 1;
+    puts("test12_1 client exit.\n");
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+#include "defines.h"
+#include "kozos.h"
+#include "lib.h"
+
+// タイムスライスのテスト
+// start_threads から consdrv_main, command_main の代わりに以下の3つを起動する
+//   kz_run(test12_2_busy,    "busy1",    10, 0x100, 0, NULL);
+//   kz_run(test12_2_busy,    "busy2",    10, 0x100, 1, NULL);
+//   kz_run(test12_2_monitor, "monitor",   5, 0x100, 0, NULL);
+// 同じ優先度の2つのスレッドがどちらも CPU を手放さずに動き続けても、
+// タイムスライスを使い切るたびに切り替わるので、両方のカウンタが増えていく
+// タイムスライスがなければ、先に動き出した busy1 だけが動き続ける
+
+#define TEST12_2_ROUNDS   5
+#define TEST12_2_INTERVAL 100 // 様子を見る間隔(ミリ秒)
+
+static volatile long busy_count[2];
+static volatile int busy_stop;
+
+int test12_2_busy(int argc, char *argv[])
+{
+    // argc でどちらのカウンタを使うかを指定する
+    puts("test12_2 busy started.\n");
+
+    // 止められるまで CPU を使い続ける(システムコールは呼ばない)
+    while (!busy_stop)
+        busy_count[argc]++;
+
+    puts("test12_2 busy exit.\n");
+
+    return 0;
+}
+
+int test12_2_monitor(int argc, char *argv[])
+{
+    long before[2];
+    int i, ng = 0;
+
+    puts("test12_2 monitor started.\n");
+
+    for (i = 0; i < TEST12_2_ROUNDS; i++) {
+        before[0] = busy_count[0];
+        before[1] = busy_count[1];
+
+        // 休んでいる間は2つの busy スレッドだけが動く
+        kz_sleep_ms(TEST12_2_INTERVAL);
+
+        // どちらのスレッドもこの間に動いていれば、CPU を分け合えている
+        puts("test12_2 busy1: ");
+        putxval(busy_count[0] - before[0], 0);
+        puts(" busy2: ");
+        putxval(busy_count[1] - before[1], 0);
+        if ((busy_count[0] == before[0]) || (busy_count[1] == before[1])) {
+            puts(" NG\n");
+            ng++;
+        } else {
+            puts(" OK\n");
+        }
+    }
+
+    puts(ng ? "test12_2 NG\n" : "test12_2 OK\n");
+
+    busy_stop = 1;
+    puts("test12_2 monitor exit.\n");
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "defines.h"
+#include "timer.h"
+
+// H8 には 16 ビットタイマ(ITU)が3チャネル組み込まれている
+#define TIMER_NUM 3
+
+// 16 ビットタイマの共通レジスタ
+#define H8_3069F_TSTR  ((volatile uint8 *)0xffff60) // タイマスタートレジスタ
+#define H8_3069F_TISRA ((volatile uint8 *)0xffff64) // タイマインタラプトステータスレジスタA
+
+// 各チャネルのレジスタが割り当たったアドレスは以下
+#define H8_3069F_TMR16_0 ((volatile struct h8_3069f_tmr16 *) 0xffff68)
+#define H8_3069F_TMR16_1 ((volatile struct h8_3069f_tmr16 *) 0xffff70)
+#define H8_3069F_TMR16_2 ((volatile struct h8_3069f_tmr16 *) 0xffff78)
+
+// チャネルごとのレジスタを構造体として表現
+struct h8_3069f_tmr16 {
+    volatile uint8 tcr;     // タイマコントロールレジスタ
+    volatile uint8 tior;    // タイマ I/O コントロールレジスタ
+    volatile uint16 tcnt;   // タイマカウンタ
+    volatile uint16 gra;    // ジェネラルレジスタA
+    volatile uint16 grb;    // ジェネラルレジスタB
+};
+
+#define H8_3069F_TMR16_TCR_TPSC_PER1  (0<<0)
+#define H8_3069F_TMR16_TCR_TPSC_PER2  (1<<0)
+#define H8_3069F_TMR16_TCR_TPSC_PER4  (2<<0)
+#define H8_3069F_TMR16_TCR_TPSC_PER8  (3<<0)
+#define H8_3069F_TMR16_TCR_CCLR_GRA   (1<<5) // GRA のコンペアマッチでカウンタをクリア
+
+#define H8_3069F_TISRA_IMFA(ch)  (1<<(ch))       // コンペアマッチ発生フラグ
+#define H8_3069F_TISRA_IMIEA(ch) (1<<((ch) + 4)) // コンペアマッチ割込み許可
+
+// φ/8 でカウントするので、1マイクロ秒あたりのカウント数は CPU_CLOCK / 8 / 1000000
+// 20MHz の場合は 2.5 カウントなので、整数演算のため分子・分母に分けておく
+#define TIMER_COUNT_MUL (CPU_CLOCK / 400000) // 1マイクロ秒 = MUL / DIV カウント
+#define TIMER_COUNT_DIV 20
+
+static struct {
+    volatile struct h8_3069f_tmr16 *tmr;
+} regs[TIMER_NUM] = {
+    { H8_3069F_TMR16_0 },
+    { H8_3069F_TMR16_1 },
+    { H8_3069F_TMR16_2 },
+};
+
+// タイマを開始する
+// usec マイクロ秒ごとにコンペアマッチ割込みが発生する(止めるまで繰り返す)
+// 16 ビットカウンタなので、20MHz では最大で約 26 ミリ秒まで
+int timer_start(int index, long usec)
+{
+    volatile struct h8_3069f_tmr16 *tmr = regs[index].tmr;
+    unsigned long count = (unsigned long)usec * TIMER_COUNT_MUL / TIMER_COUNT_DIV;
+
+    if ((count == 0) || (count > 0x10000))
+        return -1;
+
+    // 設定中はカウントを止めておく
+    *H8_3069F_TSTR &= ~(1 << index);
+
+    // φ/8 でカウントし、GRA とのコンペアマッチでカウンタをクリアする
+    tmr->tcr  = H8_3069F_TMR16_TCR_CCLR_GRA | H8_3069F_TMR16_TCR_TPSC_PER8;
+    tmr->tior = 0;
+    tmr->tcnt = 0;
+    tmr->gra  = count - 1;
+
+    // フラグをクリアしてから割込みを許可し、カウントを開始する
+    *H8_3069F_TISRA &= ~H8_3069F_TISRA_IMFA(index);
+    *H8_3069F_TISRA |= H8_3069F_TISRA_IMIEA(index);
+    *H8_3069F_TSTR |= (1 << index);
+
+    return 0;
+}
+
+// タイマを停止する
+void timer_cancel(int index)
+{
+    *H8_3069F_TSTR &= ~(1 << index);
+    *H8_3069F_TISRA &= ~(H8_3069F_TISRA_IMIEA(index) |
+                         H8_3069F_TISRA_IMFA(index));
+}
+
+// コンペアマッチが発生したか？
+int timer_is_expired(int index)
+{
+    return (*H8_3069F_TISRA & H8_3069F_TISRA_IMFA(index)) ? 1 : 0;
+}
+
+// コンペアマッチのフラグを落とし、次の割込みを受け付けられるようにする
+void timer_expire(int index)
+{
+    *H8_3069F_TISRA &= ~H8_3069F_TISRA_IMFA(index);
+}
+
+// タイマを開始してから(前回のコンペアマッチから)の経過時間をマイクロ秒で返す
+long timer_gettime(int index)
+{
+    volatile struct h8_3069f_tmr16 *tmr = regs[index].tmr;
+    return (long)((unsigned long)tmr->tcnt * TIMER_COUNT_DIV / TIMER_COUNT_MUL);
+}
@@ -0,0 +1,10 @@
+#ifndef _TIMER_H_INCLUDED_
+#define _TIMER_H_INCLUDED_
+
+int timer_start(int index, long usec);  // タイマの開始(usec マイクロ秒周期)
+void timer_cancel(int index);           // タイマの停止
+int timer_is_expired(int index);        // コンペアマッチが発生したか？
+void timer_expire(int index);           // コンペアマッチのフラグを落とす
+long timer_gettime(int index);          // 経過時間(マイクロ秒)
+
+#endif